@@ -0,0 +1,504 @@
+/*
+ * Throughput/latency benchmark for /dev/m_device (mode=0, shared buffer).
+ *
+ * Sweeps transfer size (1 B .. buffer capacity), thread count and access
+ * mode, and prints one row per case as CSV or JSON:
+ *
+ *   ./m_bench -d /dev/m_device0 -t 1,2,4 -a rw,prw,mmap,batch -n 20000 -f csv
+ *
+ * batch submits -b entries per M_IOC_BATCH call, ops and MB/s count entries
+ * but the latency columns are per ioctl.
+ *
+ * -c overrides the buffer size instead of asking the driver, which also lets
+ * the tool run against a regular file for comparison.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../m_ioctl.h"
+
+#define MAX_THREADS     64
+#define MAX_LIST        32
+
+/* Access modes */
+#define ACCESS_RW       0   /* read()/write(), rewinding the file position */
+#define ACCESS_PRW      1   /* pread()/pwrite() at offset 0 */
+#define ACCESS_MMAP     2   /* memcpy() through one mapping of the buffer */
+#define ACCESS_BATCH    3   /* M_IOC_BATCH of batch_size entries at offset 0 */
+#define NR_ACCESS       4
+
+#define OP_READ         0
+#define OP_WRITE        1
+
+static const char *access_name[NR_ACCESS] = { "rw", "prw", "mmap", "batch" };
+static const char *op_name[] = { "read", "write" };
+
+struct bench_case {
+    int access;
+    int op;
+    size_t size;
+    int threads;
+};
+
+struct thread_ctx {
+    pthread_t tid;
+    const struct bench_case *bc;
+    int fd;
+    char *map;
+    char *buf;
+    struct m_batch_ent *ents;
+    uint64_t *lat_ns;   /* One sample per operation */
+    long ops;           /* Syscalls (or memcpy() calls) */
+    long entries;       /* Transfers of up to bc->size bytes */
+    uint64_t bytes;     /* What the transfers returned, short ones included */
+    int err;
+};
+
+/* Command line options */
+static const char *dev_path = "/dev/m_device0";
+static long iterations = 10000;
+static int json_output;
+static int thread_list[MAX_LIST] = { 1 };
+static int nr_threads = 1;
+static int access_list[NR_ACCESS] = { ACCESS_RW, ACCESS_PRW, ACCESS_MMAP, ACCESS_BATCH };
+static int nr_access = NR_ACCESS;
+static size_t capacity;
+static int batch_size = 16;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of a sorted array */
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    size_t rank;
+
+    if (!n)
+        return 0;
+
+    rank = (size_t)(p / 100.0 * n + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+
+    return sorted[rank - 1];
+}
+
+/* A device without lseek() support is rewound by reopening it */
+static int rewind_fd(struct thread_ctx *ctx)
+{
+    int flags;
+
+    if (lseek(ctx->fd, 0, SEEK_SET) == 0)
+        return 0;
+
+    flags = ctx->bc->op == OP_READ ? O_RDONLY : O_WRONLY;
+    close(ctx->fd);
+    ctx->fd = open(dev_path, flags);
+    return ctx->fd < 0 ? -1 : 0;
+}
+
+static ssize_t do_one_op(struct thread_ctx *ctx)
+{
+    const struct bench_case *bc = ctx->bc;
+    ssize_t ret;
+
+    switch (bc->access) {
+    case ACCESS_RW:
+        ret = bc->op == OP_READ ? read(ctx->fd, ctx->buf, bc->size)
+                                : write(ctx->fd, ctx->buf, bc->size);
+        /* End of the buffer, start again from offset 0 */
+        if (ret == 0 || (ret < 0 && errno == ENOSPC)) {
+            if (rewind_fd(ctx))
+                return -1;
+            ret = bc->op == OP_READ ? read(ctx->fd, ctx->buf, bc->size)
+                                    : write(ctx->fd, ctx->buf, bc->size);
+        }
+        return ret;
+
+    case ACCESS_PRW:
+        return bc->op == OP_READ ? pread(ctx->fd, ctx->buf, bc->size, 0)
+                                 : pwrite(ctx->fd, ctx->buf, bc->size, 0);
+
+    case ACCESS_MMAP:
+        if (bc->op == OP_READ)
+            memcpy(ctx->buf, ctx->map, bc->size);
+        else
+            memcpy(ctx->map, ctx->buf, bc->size);
+        return bc->size;
+
+    case ACCESS_BATCH: {
+        struct m_batch batch = {
+            .ents = (uintptr_t)ctx->ents,
+            .nr = batch_size,
+        };
+        ssize_t bytes = 0;
+        int ret = ioctl(ctx->fd, M_IOC_BATCH, &batch);
+        int i;
+
+        if (ret < 0)
+            return -1;
+        /* Without M_BATCH_CONTINUE the last reported entry is the one that failed */
+        if (ret > 0 && ctx->ents[ret - 1].result < 0) {
+            errno = -ctx->ents[ret - 1].result;
+            return -1;
+        }
+        for (i = 0; i < ret; i++)
+            bytes += ctx->ents[i].result;
+        return bytes;
+    }
+    }
+
+    return -1;
+}
+
+/* Bytes are summed from the return values, a short transfer is not a full one */
+static void *bench_thread(void *arg)
+{
+    struct thread_ctx *ctx = arg;
+    uint64_t t0;
+    ssize_t ret;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+        t0 = now_ns();
+        ret = do_one_op(ctx);
+        if (ret < 0) {
+            ctx->err = errno;
+            break;
+        }
+        ctx->lat_ns[i] = now_ns() - t0;
+        ctx->bytes += ret;
+    }
+    ctx->ops = i;
+    ctx->entries = ctx->bc->access == ACCESS_BATCH ? i * batch_size : i;
+
+    return NULL;
+}
+
+/*
+ * Fill the whole buffer so reads of any size return data. Done once: writes
+ * only grow the valid size, only O_TRUNC and M_IOC_SET_SIZE shrink it.
+ */
+static int prefill(void)
+{
+    char *buf;
+    int fd;
+    int ret = 0;
+
+    fd = open(dev_path, O_WRONLY);
+    if (fd < 0)
+        return -1;
+
+    buf = malloc(capacity);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+
+    memset(buf, 0xa5, capacity);
+    if (pwrite(fd, buf, capacity, 0) != (ssize_t)capacity)
+        ret = -1;
+
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+/* Powers of two up to the capacity, then the capacity itself if it is not one */
+static size_t next_size(size_t size)
+{
+    if (size < capacity && size * 2 > capacity)
+        return capacity;
+    return size * 2;
+}
+
+static void print_header(void)
+{
+    if (json_output)
+        printf("[\n");
+    else
+        printf("access,op,size,threads,ops,bytes,secs,mb_s,ops_s,p50_ns,p99_ns,p999_ns\n");
+}
+
+static void print_footer(void)
+{
+    if (json_output)
+        printf("\n]\n");
+}
+
+static void print_row(const struct bench_case *bc, long ops, double bytes, double secs,
+                      const uint64_t *sorted, size_t n)
+{
+    static int rows;
+    double mb_s = secs > 0 ? bytes / secs / 1e6 : 0;
+    double ops_s = secs > 0 ? ops / secs : 0;
+    uint64_t p50 = percentile(sorted, n, 50.0);
+    uint64_t p99 = percentile(sorted, n, 99.0);
+    uint64_t p999 = percentile(sorted, n, 99.9);
+
+    if (json_output) {
+        printf("%s  {\"access\": \"%s\", \"op\": \"%s\", \"size\": %zu, \"threads\": %d, "
+               "\"ops\": %ld, \"bytes\": %.0f, \"secs\": %.6f, \"mb_s\": %.2f, \"ops_s\": %.0f, "
+               "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+               rows ? ",\n" : "", access_name[bc->access], op_name[bc->op], bc->size,
+               bc->threads, ops, bytes, secs, mb_s, ops_s,
+               (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999);
+    } else {
+        printf("%s,%s,%zu,%d,%ld,%.0f,%.6f,%.2f,%.0f,%llu,%llu,%llu\n",
+               access_name[bc->access], op_name[bc->op], bc->size, bc->threads,
+               ops, bytes, secs, mb_s, ops_s,
+               (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999);
+    }
+    rows++;
+    fflush(stdout);
+}
+
+static int run_case(const struct bench_case *bc)
+{
+    struct thread_ctx ctx[MAX_THREADS];
+    uint64_t *all;
+    size_t n = 0;
+    long ops = 0;
+    uint64_t bytes = 0;
+    uint64_t t0, t1;
+    int flags = bc->op == OP_READ ? O_RDONLY : O_WRONLY;
+    int prot = bc->op == OP_READ ? PROT_READ : PROT_WRITE;
+    int ret = 0;
+    int i, j;
+
+    memset(ctx, 0, sizeof(ctx));
+    for (i = 0; i < bc->threads; i++)
+        ctx[i].fd = -1;
+
+    for (i = 0; i < bc->threads; i++) {
+        ctx[i].bc = bc;
+        ctx[i].fd = open(dev_path, bc->access == ACCESS_MMAP ? O_RDWR : flags);
+        ctx[i].buf = malloc(bc->size);
+        ctx[i].lat_ns = calloc(iterations, sizeof(uint64_t));
+        if (ctx[i].fd < 0 || !ctx[i].buf || !ctx[i].lat_ns) {
+            perror("setup");
+            ret = -1;
+            goto out;
+        }
+        memset(ctx[i].buf, 0x5a, bc->size);
+
+        if (bc->access == ACCESS_BATCH) {
+            ctx[i].ents = calloc(batch_size, sizeof(*ctx[i].ents));
+            if (!ctx[i].ents) {
+                perror("setup");
+                ret = -1;
+                goto out;
+            }
+            for (j = 0; j < batch_size; j++) {
+                ctx[i].ents[j].buf = (uintptr_t)ctx[i].buf;
+                ctx[i].ents[j].len = bc->size;
+                ctx[i].ents[j].op = bc->op == OP_READ ? M_BATCH_READ : M_BATCH_WRITE;
+            }
+        }
+
+        if (bc->access == ACCESS_MMAP) {
+            ctx[i].map = mmap(NULL, capacity, prot, MAP_SHARED, ctx[i].fd, 0);
+            if (ctx[i].map == MAP_FAILED) {
+                ctx[i].map = NULL;
+                perror("mmap");
+                ret = -1;
+                goto out;
+            }
+        }
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < bc->threads; i++)
+        pthread_create(&ctx[i].tid, NULL, bench_thread, &ctx[i]);
+    for (i = 0; i < bc->threads; i++)
+        pthread_join(ctx[i].tid, NULL);
+    t1 = now_ns();
+
+    all = malloc(sizeof(uint64_t) * iterations * bc->threads);
+    if (!all) {
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < bc->threads; i++) {
+        if (ctx[i].err)
+            fprintf(stderr, "%s/%s/%zu: thread %d stopped: %s\n", access_name[bc->access],
+                    op_name[bc->op], bc->size, i, strerror(ctx[i].err));
+        memcpy(all + n, ctx[i].lat_ns, sizeof(uint64_t) * ctx[i].ops);
+        n += ctx[i].ops;
+        ops += ctx[i].entries;
+        bytes += ctx[i].bytes;
+    }
+
+    qsort(all, n, sizeof(uint64_t), cmp_u64);
+    print_row(bc, ops, bytes, (t1 - t0) / 1e9, all, n);
+    free(all);
+
+out:
+    for (i = 0; i < bc->threads; i++) {
+        if (ctx[i].map)
+            munmap(ctx[i].map, capacity);
+        if (ctx[i].fd >= 0)
+            close(ctx[i].fd);
+        free(ctx[i].buf);
+        free(ctx[i].ents);
+        free(ctx[i].lat_ns);
+    }
+    return ret;
+}
+
+static int parse_threads(char *arg)
+{
+    char *tok;
+
+    nr_threads = 0;
+    for (tok = strtok(arg, ","); tok && nr_threads < MAX_LIST; tok = strtok(NULL, ",")) {
+        thread_list[nr_threads] = atoi(tok);
+        if (thread_list[nr_threads] < 1 || thread_list[nr_threads] > MAX_THREADS)
+            return -1;
+        nr_threads++;
+    }
+
+    return nr_threads ? 0 : -1;
+}
+
+static int parse_access(char *arg)
+{
+    char *tok;
+    int i;
+
+    nr_access = 0;
+    for (tok = strtok(arg, ","); tok && nr_access < NR_ACCESS; tok = strtok(NULL, ",")) {
+        for (i = 0; i < NR_ACCESS; i++)
+            if (!strcmp(tok, access_name[i]))
+                break;
+        if (i == NR_ACCESS)
+            return -1;
+        access_list[nr_access++] = i;
+    }
+
+    return nr_access ? 0 : -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d device] [-c capacity] [-n ops_per_thread] [-t threads,...] [-a rw,prw,mmap,batch] [-b batch] [-f csv|json]\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_case bc;
+    uint64_t cap;
+    size_t size;
+    int fd, opt, a, t, op;
+
+    while ((opt = getopt(argc, argv, "d:n:t:a:b:f:c:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            capacity = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            dev_path = optarg;
+            break;
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 't':
+            if (parse_threads(optarg)) {
+                fprintf(stderr, "Invalid thread list, 1..%d\n", MAX_THREADS);
+                return 1;
+            }
+            break;
+        case 'a':
+            if (parse_access(optarg)) {
+                fprintf(stderr, "Invalid access mode list\n");
+                return 1;
+            }
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            if (batch_size < 1 || batch_size > M_BATCH_MAX) {
+                fprintf(stderr, "Batch size must be in [1, %d]\n", M_BATCH_MAX);
+                return 1;
+            }
+            break;
+        case 'f':
+            json_output = !strcmp(optarg, "json");
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd = open(dev_path, O_RDONLY);
+    if (fd < 0) {
+        perror(dev_path);
+        return 1;
+    }
+    if (!capacity) {
+        if (ioctl(fd, M_IOC_GET_CAPACITY, &cap)) {
+            perror("M_IOC_GET_CAPACITY");
+            close(fd);
+            return 1;
+        }
+        capacity = cap;
+    }
+    close(fd);
+
+    if (prefill()) {
+        perror("prefill");
+        return 1;
+    }
+
+    print_header();
+    for (a = 0; a < nr_access; a++) {
+        for (op = OP_READ; op <= OP_WRITE; op++) {
+            for (t = 0; t < nr_threads; t++) {
+                for (size = 1; size <= capacity; size = next_size(size)) {
+                    bc.access = access_list[a];
+                    bc.op = op;
+                    bc.size = size;
+                    bc.threads = thread_list[t];
+                    if (run_case(&bc))
+                        break;
+                }
+            }
+        }
+    }
+    print_footer();
+
+    return 0;
+}
@@ -3,151 +3,2150 @@
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/mm.h>       /* Define alloc_pages_exact(), struct vm_operations_struct */
+#include <linux/uaccess.h>
+#include <linux/uio.h>      /* Define struct iov_iter, copy_to_iter() */
+#include <linux/circ_buf.h> /* Define CIRC_CNT(), CIRC_SPACE() */
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/jump_label.h>
+#include <linux/xarray.h>
+#include <linux/pagemap.h>  /* Define unmap_mapping_range() */
+#include <linux/rwsem.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/sched/signal.h>
+#include <asm/ioctls.h>     /* Define FIONREAD */
+#include <linux/huge_mm.h>  /* Define thp_get_unmapped_area(), vmf_insert_folio_pmd() */
+#include <linux/version.h>
+
+#include "m_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "m_trace.h"
 
 #define DRIVER_AUTHOR "dungla anhdungxd21@mail.com"
 #define DRIVER_DESC "Hello world kernel module"
 #define DRIVER_VERS "1.0"
 
-#define NPAGES 1
+#define M_MAX_DEVICES 64
+/* Page locks of the buffer are striped, must be a power of two */
+#define M_RANGE_LOCKS 64
+
+/* Device modes, selected at load time: insmod exam.ko mode=1 ring_size=65536 */
+#define M_MODE_BUFFER   0   /* Sparse shared buffer of up to capacity bytes, mmap-able */
+#define M_MODE_STREAM   1   /* FIFO ring buffer, blocking read()/write() and poll() */
+#define M_MODE_SHM      2   /* Lock-free SPSC ring mmap'd by both sides, see struct m_shm_ctrl */
+#define M_MODE_PERCPU   3   /* Multi-producer log, per-CPU buffers merged into the ring, see struct m_rec */
+#define M_MODE_RECORD   4   /* Message queue, each write() is one record, each read() returns whole records */
+#define M_MODE_BCAST    5   /* Broadcast ring, every open file reads all data with its own cursor */
+
+/* What a write does when the record queue is full */
+#define M_REC_BLOCK         0
+#define M_REC_DROP_OLDEST   1
+
+static int mode = M_MODE_BUFFER;
+module_param(mode, int, 0444);
+MODULE_PARM_DESC(mode, "0 = shared buffer (default), 1 = streaming ring buffer, 2 = shared-memory SPSC ring, 3 = per-CPU log, 4 = record queue, 5 = broadcast");
+
+static unsigned int ring_size = 64 * 1024;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Ring buffer capacity in bytes for mode=1/2, rounded up to a power of two");
+
+static unsigned int pcpu_size = 16 * 1024;
+module_param(pcpu_size, uint, 0444);
+MODULE_PARM_DESC(pcpu_size, "Per-CPU write buffer size in bytes for mode=3, also the largest record, at most ring_size - 1");
+
+static unsigned int rec_depth = 128;
+module_param(rec_depth, uint, 0444);
+MODULE_PARM_DESC(rec_depth, "Maximum number of queued records for mode=4, ring_size also bounds the bytes");
+
+static int rec_policy = M_REC_BLOCK;
+module_param(rec_policy, int, 0444);
+MODULE_PARM_DESC(rec_policy, "Full record queue in mode=4: 0 = writer blocks (default), 1 = drop the oldest record");
+
+static unsigned long capacity = 1024 * 1024;
+module_param(capacity, ulong, 0444);
+MODULE_PARM_DESC(capacity, "Logical size in bytes of each buffer for mode=0, pages are only allocated when touched");
+
+static unsigned int buf_order;
+module_param(buf_order, uint, 0444);
+MODULE_PARM_DESC(buf_order, "Allocation order of the mode=0 buffer, 0 = 4 KiB pages (default), 9 = 2 MiB PMD-mapped folios on x86-64");
+
+static int ndevices = 1;
+module_param(ndevices, int, 0444);
+MODULE_PARM_DESC(ndevices, "Number of /dev/m_deviceN minors, each with its own buffer and lock");
+
+static bool latency_stats;
+module_param(latency_stats, bool, 0444);
+MODULE_PARM_DESC(latency_stats, "Collect per-operation latency histograms in debugfs (costs two clock reads per call)");
+
+/* Patched to a jump when latency_stats=1, a plain nop otherwise */
+static DEFINE_STATIC_KEY_FALSE(m_latency_key);
+
+/* Operations with a latency histogram */
+#define M_OP_READ       0
+#define M_OP_WRITE      1
+#define M_NR_OPS        2
+
+/* Bucket i counts calls that took [2^i, 2^(i+1)) ns, the last one is open ended */
+#define M_LAT_BUCKETS   32
+
+/* Per-CPU so the hot path never bounces a shared cache line */
+struct m_stats {
+    u64 reads;
+    u64 writes;
+    u64 bytes_out;      /* Returned by read() */
+    u64 bytes_in;       /* Accepted by write() */
+    u64 efaults;
+    u64 short_writes;
+    u64 drops;          /* Records dropped by rec_policy=1 */
+    u64 overruns;       /* Broadcast readers that fell a whole ring behind */
+    u64 lat[M_NR_OPS][M_LAT_BUCKETS];
+};
 
 static int m_open(struct inode *inode, struct file *file);
 static int m_release(struct inode *inode, struct file *file);
-static ssize_t m_read(struct file *filp, char __user *user_buf, size_t size, loff_t * offset);
-static ssize_t m_write(struct file *filp, const char __user *user_buf, size_t size, loff_t * offset);
+static ssize_t m_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t m_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static loff_t m_llseek(struct file *filp, loff_t offset, int whence);
+static int m_mmap(struct file *filp, struct vm_area_struct *vma);
+static long m_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static __poll_t m_poll(struct file *filp, poll_table *wait);
+
+struct m_chdev;
+static int m_buf_truncate(struct m_chdev *dev, struct address_space *mapping, loff_t newsize);
+
+/*
+ * Per-CPU log mode: writers only take the mutex of the CPU they run on, it is
+ * shared with nobody but the merge. The merge swaps buf and drain, then moves
+ * the drained records to the ring without holding the CPU's lock.
+ */
+struct m_pcpu {
+    struct mutex lock;
+    char *buf;                  /* Records appended by writers on this CPU */
+    size_t len;
+    char *drain;                /* Owned by the merge, under m_chdev.lock */
+    size_t drain_off;
+    size_t drain_len;
+    u64 seq;
+    u32 cpu;
+};
+
+/* Per open file, file->private_data */
+struct m_file {
+    struct m_chdev *dev;
+    u32 rec_flags;              /* M_REC_* from M_IOC_SET_REC_FLAGS */
+    /* Broadcast mode: next byte this file reads, compared with m_chdev.bc_head */
+    unsigned long cursor;
+    struct mutex read_lock;     /* Two threads reading one file share the cursor */
+};
 
+/* One instance per minor, nothing is shared between two minors */
 struct m_chdev {
-    int32_t size;
-    char *kmalloc_ptr;
+    /* Buffer mode: page index -> struct page, holes read back as zeros */
+    struct xarray pages;
+    loff_t size;                /* Number of valid bytes, read through m_buf_size() */
+    loff_t capacity;
+    unsigned int order;         /* Folios are tried at this order, order-0 is the fallback */
+    seqlock_t size_seq;         /* Readers retry instead of taking a lock */
+    // Đọc song song trên cùng page thì không chặn nhau, ghi thì độc quyền page đó
+    struct rw_semaphore range_lock[M_RANGE_LOCKS];
+    /* Held for read by writers, for write by truncate */
+    struct percpu_rw_semaphore trunc_sem;
+
+    /* Shared-memory ring mode: control page followed by the data pages */
+    // Page-backed (not slab) so every page can be mapped to user space
+    char *buf_ptr;
+    size_t buf_len;
+    struct m_shm_ctrl *shm;
+
+    /* Streaming mode: ring.head is advanced by writers, ring.tail by readers */
+    struct circ_buf ring;
+    size_t ring_size;           /* Power of two, also used by the shared-memory ring */
+    struct m_pcpu __percpu *pcpu;   /* Per-CPU log mode, feeds the ring above */
+    unsigned int nr_recs;       /* Record mode: u32 length + payload each, in the ring */
+    /*
+     * Broadcast mode, free running byte counters: the writer bumps bc_start
+     * before it overwrites old data and publishes bc_head once the new data
+     * is in. Bytes before bc_start - ring_size may be garbage.
+     */
+    unsigned long bc_start;
+    unsigned long bc_head;
+    struct mutex lock;          /* Serializes ring updates and truncation of this minor */
+    wait_queue_head_t read_wq;  /* Readers/consumers waiting for data */
+    wait_queue_head_t write_wq; /* Writers/producers waiting for space */
+
+    struct m_stats __percpu *stats;
+    struct dentry *debugfs_dir;
+
     dev_t dev_num;
-    // /sys/class/
-    struct class *m_class;
+    struct device *device;
     // Đại diện cho character device dưới kernel
     struct cdev m_cdev;
-} m_dev;
+};
+
+/* First device number, minor i belongs to m_devs[i] */
+static dev_t m_dev_num;
+// /sys/class/
+static struct class *m_class;
+static struct m_chdev *m_devs;
+// /sys/kernel/debug/m_device/
+static struct dentry *m_debugfs_root;
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
-    .read = m_read,
-    .write = m_write,
+    /* read()/write(), readv()/writev(), io_uring and splice all go through the iter ops */
+    .read_iter = m_read_iter,
+    .write_iter = m_write_iter,
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
+    .llseek = m_llseek,
     .open = m_open,
     .release = m_release,
+    .mmap = m_mmap,
+    /* PMD-aligned addresses for mappings of 2 MiB and more */
+    .get_unmapped_area = thp_get_unmapped_area,
+    .unlocked_ioctl = m_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .poll = m_poll,
+};
+
+static void m_free_pcpu(struct m_chdev *dev)
+{
+    struct m_pcpu *pc;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        pc = per_cpu_ptr(dev->pcpu, cpu);
+        kvfree(pc->buf);
+        kvfree(pc->drain);
+    }
+    free_percpu(dev->pcpu);
+    dev->pcpu = NULL;
+}
+
+/* Two buffers per possible CPU, a CPU that comes online later already has its own */
+static int m_alloc_pcpu(struct m_chdev *dev)
+{
+    struct m_pcpu *pc;
+    int cpu;
+
+    dev->pcpu = alloc_percpu(struct m_pcpu);
+    if (!dev->pcpu)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        pc = per_cpu_ptr(dev->pcpu, cpu);
+        mutex_init(&pc->lock);
+        pc->cpu = cpu;
+        pc->buf = kvmalloc(pcpu_size, GFP_KERNEL);
+        pc->drain = kvmalloc(pcpu_size, GFP_KERNEL);
+        if (!pc->buf || !pc->drain) {
+            m_free_pcpu(dev);
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+static struct m_chdev *m_dev(struct file *file)
+{
+    return ((struct m_file *)file->private_data)->dev;
+}
+
+/* Modes that move data through dev->ring, FIFOs without a file position */
+static bool m_ring_mode(void)
+{
+    return mode == M_MODE_STREAM || mode == M_MODE_PERCPU ||
+           mode == M_MODE_RECORD || mode == M_MODE_BCAST;
+}
+
+static int m_alloc_buffer(struct m_chdev *dev)
+{
+    int i;
+
+    if (m_ring_mode()) {
+        dev->ring_size = roundup_pow_of_two(max_t(size_t, ring_size, PAGE_SIZE));
+        dev->ring.buf = kvzalloc(dev->ring_size, GFP_KERNEL);
+        dev->ring.head = 0;
+        dev->ring.tail = 0;
+        if (!dev->ring.buf)
+            return -ENOMEM;
+        dev->nr_recs = 0;
+        dev->bc_start = 0;
+        dev->bc_head = 0;
+        if (mode != M_MODE_PERCPU)
+            return 0;
+
+        if (m_alloc_pcpu(dev)) {
+            kvfree(dev->ring.buf);
+            dev->ring.buf = NULL;
+            return -ENOMEM;
+        }
+        return 0;
+    }
+
+    /* Nothing is allocated up front, pages come and go with writes and truncation */
+    if (mode == M_MODE_BUFFER) {
+        xa_init(&dev->pages);
+        seqlock_init(&dev->size_seq);
+        for (i = 0; i < M_RANGE_LOCKS; i++)
+            init_rwsem(&dev->range_lock[i]);
+        dev->size = 0;
+        dev->capacity = capacity;
+        dev->order = buf_order;
+        return percpu_init_rwsem(&dev->trunc_sem);
+    }
+
+    /* Shared-memory ring: one control page followed by the data pages */
+    dev->ring_size = roundup_pow_of_two(max_t(size_t, ring_size, PAGE_SIZE));
+    dev->buf_len = PAGE_SIZE + dev->ring_size;
+
+    // alloc_pages_exact() trả về các page order-0 riêng lẻ, mỗi page có refcount
+    // riêng nên có thể map từng page vào user space trong m_vm_fault()
+    dev->buf_ptr = alloc_pages_exact(dev->buf_len, GFP_KERNEL | __GFP_ZERO);
+    if (!dev->buf_ptr)
+        return -ENOMEM;
+
+    BUILD_BUG_ON(sizeof(struct m_shm_ctrl) > PAGE_SIZE);
+    dev->shm = (struct m_shm_ctrl *)dev->buf_ptr;
+    dev->shm->ring_size = dev->ring_size;
+    dev->shm->data_off = PAGE_SIZE;
+
+    return 0;
+}
+
+static void m_free_buffer(struct m_chdev *dev)
+{
+    struct folio *folio;
+    unsigned long index;
+
+    if (mode == M_MODE_BUFFER) {
+        /* A large folio is one multi-index entry, visited once */
+        xa_for_each(&dev->pages, index, folio)
+            folio_put(folio);
+        xa_destroy(&dev->pages);
+        percpu_free_rwsem(&dev->trunc_sem);
+    }
+    if (dev->pcpu)
+        m_free_pcpu(dev);
+    if (dev->ring.buf) {
+        kvfree(dev->ring.buf);
+        dev->ring.buf = NULL;
+    }
+    if (dev->buf_ptr) {
+        free_pages_exact(dev->buf_ptr, dev->buf_len);
+        dev->buf_ptr = NULL;
+        dev->shm = NULL;
+    }
+}
+
+static u64 m_lat_start(void)
+{
+    return static_branch_unlikely(&m_latency_key) ? ktime_get_ns() : 0;
+}
+
+static void m_stats_account(struct m_chdev *dev, int op, size_t count, ssize_t ret, u64 start)
+{
+    struct m_stats __percpu *st = dev->stats;
+    u64 delta;
+
+    if (op == M_OP_READ) {
+        this_cpu_inc(st->reads);
+        if (ret > 0)
+            this_cpu_add(st->bytes_out, ret);
+    } else {
+        this_cpu_inc(st->writes);
+        if (ret > 0)
+            this_cpu_add(st->bytes_in, ret);
+        if (ret >= 0 && (size_t)ret < count)
+            this_cpu_inc(st->short_writes);
+    }
+
+    if (ret == -EFAULT)
+        this_cpu_inc(st->efaults);
+
+    if (start) {
+        delta = ktime_get_ns() - start;
+        this_cpu_inc(st->lat[op][min(ilog2(delta | 1), M_LAT_BUCKETS - 1)]);
+    }
+}
+
+static void m_stats_sum(struct m_chdev *dev, struct m_stats *sum)
+{
+    struct m_stats *st;
+    int cpu, op, i;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(dev->stats, cpu);
+        sum->reads += st->reads;
+        sum->writes += st->writes;
+        sum->bytes_out += st->bytes_out;
+        sum->bytes_in += st->bytes_in;
+        sum->efaults += st->efaults;
+        sum->short_writes += st->short_writes;
+        sum->drops += st->drops;
+        sum->overruns += st->overruns;
+        for (op = 0; op < M_NR_OPS; op++)
+            for (i = 0; i < M_LAT_BUCKETS; i++)
+                sum->lat[op][i] += st->lat[op][i];
+    }
+}
+
+static int m_stats_show(struct seq_file *m, void *v)
+{
+    struct m_chdev *dev = m->private;
+    struct m_stats *sum;
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+
+    m_stats_sum(dev, sum);
+    seq_printf(m, "reads: %llu\n", sum->reads);
+    seq_printf(m, "writes: %llu\n", sum->writes);
+    seq_printf(m, "bytes_out: %llu\n", sum->bytes_out);
+    seq_printf(m, "bytes_in: %llu\n", sum->bytes_in);
+    seq_printf(m, "efaults: %llu\n", sum->efaults);
+    seq_printf(m, "short_writes: %llu\n", sum->short_writes);
+    seq_printf(m, "drops: %llu\n", sum->drops);
+    seq_printf(m, "overruns: %llu\n", sum->overruns);
+
+    kfree(sum);
+    return 0;
+}
+
+static int m_latency_show(struct seq_file *m, void *v)
+{
+    static const char * const op_name[M_NR_OPS] = { "read", "write" };
+    struct m_chdev *dev = m->private;
+    struct m_stats *sum;
+    int op, i;
+
+    if (!static_branch_unlikely(&m_latency_key)) {
+        seq_puts(m, "disabled, load with latency_stats=1\n");
+        return 0;
+    }
+
+    sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+
+    m_stats_sum(dev, sum);
+    seq_puts(m, "op     from_ns    count\n");
+    for (op = 0; op < M_NR_OPS; op++)
+        for (i = 0; i < M_LAT_BUCKETS; i++)
+            if (sum->lat[op][i])
+                seq_printf(m, "%-6s %-10llu %llu\n", op_name[op], 1ULL << i, sum->lat[op][i]);
+
+    kfree(sum);
+    return 0;
+}
+
+/* Any write to stats or latency zeroes all counters of the device */
+static ssize_t m_stats_reset(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+    struct m_chdev *dev = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct m_stats));
+
+    return len;
+}
+
+static int m_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, m_stats_show, inode->i_private);
+}
+
+static int m_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, m_latency_show, inode->i_private);
+}
+
+static const struct file_operations m_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = m_stats_open,
+    .read = seq_read,
+    .write = m_stats_reset,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations m_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = m_latency_open,
+    .read = seq_read,
+    .write = m_stats_reset,
+    .llseek = seq_lseek,
+    .release = single_release,
 };
 
+/* Bring up /dev/m_device<index> */
+static int m_setup_device(struct m_chdev *dev, int index)
+{
+    int ret;
+
+    dev->dev_num = MKDEV(MAJOR(m_dev_num), MINOR(m_dev_num) + index);
+    mutex_init(&dev->lock);
+    init_waitqueue_head(&dev->read_wq);
+    init_waitqueue_head(&dev->write_wq);
+
+    dev->stats = alloc_percpu(struct m_stats);
+    if (!dev->stats)
+        return -ENOMEM;
+
+    /* 1.0 Allocate kernel buffer before the device goes live */
+    ret = m_alloc_buffer(dev);
+    if (ret < 0) {
+        pr_err("Cannot allocate memory for m_device%d\n", index);
+        goto rm_stats;
+    }
+
+    /* 2.0 Creating cdev structure */
+    cdev_init(&dev->m_cdev, &fops);
+    dev->m_cdev.owner = THIS_MODULE;
+
+    /* 2.1 Adding character devices to the system */
+    ret = cdev_add(&dev->m_cdev, dev->dev_num, 1);
+    if (ret < 0) {
+        pr_err("Cannot add m_device%d to the system\n", index);
+        goto rm_buffer;
+    }
+
+    /* 3.0 Creating device /dev/m_device<index> */
+    dev->device = device_create(m_class, NULL, dev->dev_num, dev, "m_device%d", index);
+    if (IS_ERR(dev->device)) {
+        ret = PTR_ERR(dev->device);
+        dev->device = NULL;
+        pr_err("Cannot create m_device%d\n", index);
+        goto rm_cdev;
+    }
+
+    /* 4.0 Counters, debugfs failures are not fatal */
+    dev->debugfs_dir = debugfs_create_dir(dev_name(dev->device), m_debugfs_root);
+    debugfs_create_file("stats", 0600, dev->debugfs_dir, dev, &m_stats_fops);
+    debugfs_create_file("latency", 0600, dev->debugfs_dir, dev, &m_latency_fops);
+
+    return 0;
+
+rm_cdev:
+    cdev_del(&dev->m_cdev);
+rm_buffer:
+    m_free_buffer(dev);
+rm_stats:
+    free_percpu(dev->stats);
+    return ret;
+}
+
+static void m_destroy_device(struct m_chdev *dev)
+{
+    debugfs_remove_recursive(dev->debugfs_dir);
+    device_destroy(m_class, dev->dev_num);
+    cdev_del(&dev->m_cdev);
+    m_free_buffer(dev);
+    free_percpu(dev->stats);
+}
+
 /* Constructor */
 static int __init chdev_init(void)
 {
+    size_t ring = roundup_pow_of_two(max_t(size_t, ring_size, PAGE_SIZE));
+    int ret;
+    int i;
+
+    if (mode < M_MODE_BUFFER || mode > M_MODE_BCAST) {
+        pr_err("Invalid mode %d\n", mode);
+        return -EINVAL;
+    }
+
+    /* Large folios live in multi-index xarray entries */
+    if (buf_order && (!IS_ENABLED(CONFIG_XARRAY_MULTI) || buf_order > MAX_PAGE_ORDER)) {
+        pr_warn("buf_order %u not supported, using single pages\n", buf_order);
+        buf_order = 0;
+    }
+
+    if (mode == M_MODE_RECORD && (!rec_depth ||
+        (rec_policy != M_REC_BLOCK && rec_policy != M_REC_DROP_OLDEST))) {
+        pr_err("Invalid rec_depth %u or rec_policy %d\n", rec_depth, rec_policy);
+        return -EINVAL;
+    }
+
+    /* The merge moves whole records, a bigger one would never fit in the ring */
+    if (mode == M_MODE_PERCPU && pcpu_size > ring - 1) {
+        pcpu_size = ring - 1;
+        pr_warn("pcpu_size larger than the ring, using %u\n", pcpu_size);
+    }
+
+    if (ndevices < 1 || ndevices > M_MAX_DEVICES) {
+        pr_err("ndevices must be in [1, %d]\n", M_MAX_DEVICES);
+        return -EINVAL;
+    }
+
     /* 1.0 Dynamic allocating device number (cat /proc/devices) */
     // trong alloc_chrdev_region, 0 là giá trị bắt đầu của minor
-    // 1 số lượng minor
-    if (alloc_chrdev_region(&m_dev.dev_num, 0, 1, "dev_num") < 0) {
+    // ndevices số lượng minor
+    ret = alloc_chrdev_region(&m_dev_num, 0, ndevices, "dev_num");
+    if (ret < 0) {
         pr_err("Failed to alloc chrdev region\n");
-        return -1;
+        return ret;
     }
 
     // dev_t dev = MKDEV(173, 0);
-    // register_chrdev_region(&m_dev.dev_num, 1, "m-cdev")
+    // register_chrdev_region(&m_dev_num, 1, "m-cdev")
 
     pr_info("DevLinux: hello world kernel module!\n");
-    pr_info("Major = %d Minor = %d\n", MAJOR(m_dev.dev_num), MINOR(m_dev.dev_num));
+    pr_info("Major = %d Minor = %d..%d\n", MAJOR(m_dev_num), MINOR(m_dev_num),
+            MINOR(m_dev_num) + ndevices - 1);
 
     /* 2.0 Creating struct class */
-    if ((m_dev.m_class = class_create(THIS_MODULE, "m_class")) == NULL) {
+    m_class = class_create("m_class");
+    if (IS_ERR(m_class)) {
         pr_err("Cannot create the struct class for my device\n");
+        ret = PTR_ERR(m_class);
         goto rm_device_numb;
     }
 
-    /* 3.0 Creating devcie*/
-    if ((device_create(m_dev.m_class, NULL, m_dev.dev_num, NULL, "m_device")) == NULL) {
-        pr_err("Cannot create my device\n");
-        goto rm_class;
-    }
-
-    /* 4.0 Creating cdev structure */
-    cdev_init(&m_dev.m_cdev, &fops);
+    if (latency_stats)
+        static_branch_enable(&m_latency_key);
+    m_debugfs_root = debugfs_create_dir("m_device", NULL);
 
-    /* 4.1 Adding character devices to the system */
-    if (cdev_add(&m_dev.m_cdev, m_dev.dev_num, 1) < 0) {
-        pr_err("Cannot add the device to the system\n");
-        goto rm_device;
+    /* 3.0 Creating one device per minor */
+    m_devs = kcalloc(ndevices, sizeof(*m_devs), GFP_KERNEL);
+    if (!m_devs) {
+        ret = -ENOMEM;
+        goto rm_class;
     }
 
-    /* 5.0 Allocate kernel buffer*/
-    m_dev.kmalloc_ptr = kmalloc(NPAGES * PAGE_SIZE, GFP_KERNEL);
-    if (!m_dev.kmalloc_ptr){
-        pr_err("Cannot allocate memory");
-        goto rm_device;
+    for (i = 0; i < ndevices; i++) {
+        ret = m_setup_device(&m_devs[i], i);
+        if (ret < 0)
+            goto rm_devices;
     }
 
     return 0;
 
 
-rm_device:
-    device_destroy(m_dev.m_class, m_dev.dev_num);
+rm_devices:
+    while (i--)
+        m_destroy_device(&m_devs[i]);
+    kfree(m_devs);
 rm_class:
-    class_destroy(m_dev.m_class);
+    debugfs_remove_recursive(m_debugfs_root);
+    class_destroy(m_class);
 rm_device_numb:
-    unregister_chrdev_region(m_dev.dev_num, 1);
-    return -1;
+    unregister_chrdev_region(m_dev_num, ndevices);
+    return ret;
 }
 
 /* Destructor */
 /* Tất cả tài nguyên cấp phát ở init phải được huỷ cấp phát ở exit*/
 static void __exit chdev_exit(void)
 {
-    if (m_dev.kmalloc_ptr) {
-        kfree(m_dev.kmalloc_ptr);
-        m_dev.kmalloc_ptr = NULL;
-    }
-    cdev_del(&m_dev.m_cdev);
-    device_destroy(m_dev.m_class, m_dev.dev_num);
-    class_destroy(m_dev.m_class);
-    unregister_chrdev_region(m_dev.dev_num, 1);
+    int i;
+
+    for (i = 0; i < ndevices; i++)
+        m_destroy_device(&m_devs[i]);
+    kfree(m_devs);
+    debugfs_remove_recursive(m_debugfs_root);
+    class_destroy(m_class);
+    unregister_chrdev_region(m_dev_num, ndevices);
     pr_info("DevLinux: goodbye\n");
 }
 
 static int m_open(struct inode *inode, struct file *file){
-    pr_info("System call open() called ...!!!\n");
-    return 0;
+    struct m_chdev *dev = container_of(inode->i_cdev, struct m_chdev, m_cdev);
+    struct m_file *mf;
+    int ret = 0;
+
+    trace_m_open(MINOR(dev->dev_num), file->f_flags);
+
+    mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+    if (!mf)
+        return -ENOMEM;
+    mf->dev = dev;
+    mutex_init(&mf->read_lock);
+    /* A new subscriber starts with what is written from now on */
+    mf->cursor = smp_load_acquire(&dev->bc_head);
+    file->private_data = mf;
+
+    /* Reads and writes honour IOCB_NOWAIT, io_uring may issue them inline */
+    file->f_mode |= FMODE_NOWAIT;
+
+    /* echo data > /dev/m_device0 replaces the old content */
+    if (mode == M_MODE_BUFFER && (file->f_flags & O_TRUNC) && (file->f_mode & FMODE_WRITE))
+        ret = m_buf_truncate(dev, file->f_mapping, 0);
+
+    /* A FIFO has no file position, pread()/pwrite()/lseek() get -ESPIPE */
+    if (m_ring_mode())
+        ret = stream_open(inode, file);
+
+    if (ret)
+        kfree(mf);
+    return ret;
 }
 static int m_release(struct inode *inode, struct file *file){
-    pr_info("System call release() called ...!!!\n");
+    struct m_chdev *dev = m_dev(file);
+
+    trace_m_release(MINOR(dev->dev_num));
+    kfree(file->private_data);
     return 0;
 }
-static ssize_t m_read(struct file *filp, char __user *user_buf, size_t size, loff_t * offset){
-    size_t to_read;
 
-    pr_info("System call read() called ...!!!\n");
-    
-    /* Check size doesn't exceed our mapped area size*/
-    to_read = (size > m_dev.size - *offset) ? (m_dev.size - *offset): size;
+/*
+ * Lockless lookup with the same speculative reference as the page cache: the
+ * page may be freed by a truncate between xa_load() and the get, so only
+ * trust it once the reference is held and the slot still points at it.
+ */
+static struct page *m_buf_find_page(struct m_chdev *dev, pgoff_t index)
+{
+    struct folio *folio;
 
-    /* Copy from mapped area to user buffer */
-    if (copy_to_user(user_buf, m_dev.kmalloc_ptr + *offset, to_read) !=0){
-        return -EFAULT;
+    rcu_read_lock();
+repeat:
+    folio = xa_load(&dev->pages, index);
+    if (folio) {
+        if (!folio_try_get(folio))
+            goto repeat;
+        if (unlikely(folio != xa_load(&dev->pages, index))) {
+            folio_put(folio);
+            goto repeat;
+        }
     }
+    rcu_read_unlock();
 
-    *offset += to_read;
-    return to_read;
+    /* Folios are stored naturally aligned, the low bits pick the page */
+    return folio ? folio_page(folio, index & (folio_nr_pages(folio) - 1)) : NULL;
 }
-static ssize_t m_write(struct file *filp, const char __user *user_buf, size_t size, loff_t * offset){
-    size_t to_write;
 
-    pr_info("System call write() called ...!!!\n");
+/*
+ * Allocate the folio that will hold index: a dev->order folio when its whole
+ * aligned range is free and inside the capacity, a single page otherwise or
+ * when memory is too fragmented. It is stored as one multi-index entry like
+ * the page cache does. Returns with the caller's reference held on top of the
+ * xarray's one, -EEXIST if another writer got there first.
+ */
+static struct folio *m_buf_alloc_folio(struct m_chdev *dev, pgoff_t index)
+{
+    unsigned long nr = 1UL << dev->order;
+    unsigned long first = round_down(index, nr);
+    unsigned long found = first;
+    struct folio *folio = NULL;
+    XA_STATE(xas, &dev->pages, index);
+
+    if (dev->order && ((loff_t)(first + nr) << PAGE_SHIFT) <= dev->capacity &&
+        !xa_find(&dev->pages, &found, first + nr - 1, XA_PRESENT)) {
+        folio = folio_alloc(GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY,
+                            dev->order);
+        if (folio)
+            xas_set_order(&xas, index, dev->order);
+    }
+    if (!folio) {
+        folio = folio_alloc(GFP_HIGHUSER | __GFP_ZERO, 0);
+        if (!folio)
+            return ERR_PTR(-ENOMEM);
+    }
 
-    /* check size doesn't exceed our mapped area size*/
-    to_write = (size + *offset > NPAGES * PAGE_SIZE) ? (NPAGES * PAGE_SIZE - *offset) : size;
+    /* Two references: one for the xarray, one for the caller */
+    folio_get(folio);
+    do {
+        xas_lock(&xas);
+        if (xas_find_conflict(&xas))
+            xas_set_err(&xas, -EEXIST);
+        else
+            xas_store(&xas, folio);
+        xas_unlock(&xas);
+    } while (xas_nomem(&xas, GFP_KERNEL));
 
-    /* Copy from user buffer to mapped area */
-    memset(m_dev.kmalloc_ptr, 0, NPAGES * PAGE_SIZE);
-    if (copy_from_user(m_dev.kmalloc_ptr + *offset, user_buf, to_write) !=0){
-        return -EFAULT;
+    if (xas_error(&xas)) {
+        folio_put(folio);
+        folio_put(folio);
+        return ERR_PTR(xas_error(&xas));
     }
-    pr_info("Data from user: %s", m_dev.kmalloc_ptr);
-    *offset += to_write;
-    m_dev.size = *offset;
+
+    return folio;
+}
+
+/* Find or allocate the page at index, returned with a reference held */
+static struct page *m_buf_get_page(struct m_chdev *dev, pgoff_t index)
+{
+    struct folio *folio;
+    struct page *page;
+
+    for (;;) {
+        page = m_buf_find_page(dev, index);
+        if (page)
+            return page;
+
+        folio = m_buf_alloc_folio(dev, index);
+        if (!IS_ERR(folio))
+            return folio_page(folio, index & (folio_nr_pages(folio) - 1));
+        /* Lost the race with another writer, use its folio */
+        if (PTR_ERR(folio) != -EEXIST)
+            return ERR_CAST(folio);
+    }
+}
+
+/* Page i and page i + M_RANGE_LOCKS share a lock, neighbouring pages never do */
+static struct rw_semaphore *m_range_lock(struct m_chdev *dev, pgoff_t index)
+{
+    return &dev->range_lock[index & (M_RANGE_LOCKS - 1)];
+}
+
+/* loff_t is not atomic on 32-bit, a seqlock gives a consistent snapshot */
+static loff_t m_buf_size(struct m_chdev *dev)
+{
+    unsigned int seq;
+    loff_t size;
+
+    do {
+        seq = read_seqbegin(&dev->size_seq);
+        size = dev->size;
+    } while (read_seqretry(&dev->size_seq, seq));
+
     return size;
 }
 
+static void m_buf_set_size(struct m_chdev *dev, loff_t size)
+{
+    write_seqlock(&dev->size_seq);
+    dev->size = size;
+    write_sequnlock(&dev->size_seq);
+}
+
+static void m_buf_extend(struct m_chdev *dev, loff_t end)
+{
+    /* Overwriting existing data is the common case, keep it off the write side */
+    if (end <= m_buf_size(dev))
+        return;
+
+    write_seqlock(&dev->size_seq);
+    if (end > dev->size)
+        dev->size = end;
+    write_sequnlock(&dev->size_seq);
+}
+
+/*
+ * Set the valid size. Shrinking unmaps and frees every folio past the new end
+ * and zeroes what is left past it in the last one, so growing again reads
+ * zeros. A large folio straddling the end is kept until it is wholly past it.
+ */
+static int m_buf_truncate(struct m_chdev *dev, struct address_space *mapping, loff_t newsize)
+{
+    pgoff_t first = DIV_ROUND_UP(newsize, PAGE_SIZE);
+    struct rw_semaphore *lock;
+    struct folio *folio;
+    struct page *page;
+    unsigned long index, base, nr;
+
+    if (newsize < 0 || newsize > dev->capacity)
+        return -EINVAL;
+
+    /* Wait for in-flight writers, they must not bring back a page we free */
+    percpu_down_write(&dev->trunc_sem);
+    if (newsize < dev->size) {
+        unmap_mapping_range(mapping, (loff_t)first << PAGE_SHIFT, 0, 1);
+
+        xa_for_each_start(&dev->pages, index, folio, first) {
+            nr = folio_nr_pages(folio);
+            base = round_down(index, nr);
+            if (base < first) {
+                folio_zero_range(folio, (first - base) << PAGE_SHIFT,
+                                 (base + nr - first) << PAGE_SHIFT);
+                continue;
+            }
+            xa_erase(&dev->pages, index);
+            folio_put(folio);
+        }
+
+        if (offset_in_page(newsize)) {
+            page = m_buf_find_page(dev, newsize >> PAGE_SHIFT);
+            if (page) {
+                lock = m_range_lock(dev, newsize >> PAGE_SHIFT);
+                down_write(lock);
+                zero_user_segment(page, offset_in_page(newsize), PAGE_SIZE);
+                up_write(lock);
+                put_page(page);
+            }
+        }
+    }
+
+    m_buf_set_size(dev, newsize);
+    percpu_up_write(&dev->trunc_sem);
+
+    return 0;
+}
+
+/*
+ * Readers take no device-wide lock: the size comes from a seqlock snapshot
+ * and only the lock of the page being copied is held, shared with other readers.
+ */
+static ssize_t m_buf_read(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *to)
+{
+    loff_t pos = iocb->ki_pos;
+    loff_t size = m_buf_size(dev);
+    size_t count, chunk, offset, n;
+    size_t copied = 0;
+    struct rw_semaphore *lock;
+    struct page *page;
+    ssize_t ret = -EFAULT;
+
+    if (pos >= size)
+        return 0;
+
+    /* Check size doesn't exceed the valid data */
+    count = min_t(size_t, iov_iter_count(to), size - pos);
+
+    while (copied < count) {
+        offset = offset_in_page(pos);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - copied);
+
+        lock = m_range_lock(dev, pos >> PAGE_SHIFT);
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            if (!down_read_trylock(lock)) {
+                ret = -EAGAIN;
+                break;
+            }
+        } else {
+            down_read(lock);
+        }
+
+        /*
+         * to may be an mmap of this device: its fault takes trunc_sem, and a
+         * truncate holding trunc_sem waits for our page lock. Copy without
+         * faulting, fault the destination in with the page lock dropped.
+         * Never-written pages are holes, no need to allocate them.
+         */
+        pagefault_disable();
+        page = m_buf_find_page(dev, pos >> PAGE_SHIFT);
+        if (page) {
+            n = copy_page_to_iter(page, offset, chunk, to);
+            put_page(page);
+        } else {
+            n = iov_iter_zero(chunk, to);
+        }
+        pagefault_enable();
+        up_read(lock);
+
+        pos += n;
+        copied += n;
+        if (n == chunk)
+            continue;
+
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            ret = -EAGAIN;
+            break;
+        }
+        if (fault_in_iov_iter_writeable(to, chunk - n) == chunk - n)
+            break;
+    }
+
+    if (!copied)
+        return ret;
+
+    iocb->ki_pos = pos;
+    return copied;
+}
+
+/*
+ * Only the pages covered by the write are touched (and allocated if needed).
+ * Each page is locked exclusively while it is copied, so writers of disjoint
+ * ranges run in parallel and a reader never sees half of a page update.
+ */
+static ssize_t m_buf_write(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+    loff_t pos = iocb->ki_pos;
+    size_t count, chunk, offset, n;
+    size_t copied = 0;
+    struct rw_semaphore *lock;
+    struct page *page;
+    ssize_t ret = 0;
+
+    if (pos >= dev->capacity)
+        return -ENOSPC;
+
+    /* check size doesn't exceed the capacity */
+    count = min_t(size_t, iov_iter_count(from), dev->capacity - pos);
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!percpu_down_read_trylock(&dev->trunc_sem))
+            return -EAGAIN;
+    } else {
+        percpu_down_read(&dev->trunc_sem);
+    }
+
+    while (copied < count) {
+        offset = offset_in_page(pos);
+        chunk = min_t(size_t, PAGE_SIZE - offset, count - copied);
+
+        lock = m_range_lock(dev, pos >> PAGE_SHIFT);
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            if (!down_write_trylock(lock)) {
+                ret = -EAGAIN;
+                break;
+            }
+        } else {
+            down_write(lock);
+        }
+
+        page = m_buf_get_page(dev, pos >> PAGE_SHIFT);
+        if (IS_ERR(page)) {
+            up_write(lock);
+            ret = PTR_ERR(page);
+            break;
+        }
+
+        /*
+         * from may be an mmap of this device, whose fault handler takes
+         * trunc_sem as well: a pending truncate would block it behind us.
+         * Copy without faulting, fault the source in with trunc_sem dropped.
+         */
+        pagefault_disable();
+        n = copy_page_from_iter_atomic(page, offset, chunk, from);
+        pagefault_enable();
+        up_write(lock);
+        put_page(page);
+
+        pos += n;
+        copied += n;
+        if (n == chunk)
+            continue;
+
+        if (copied)
+            m_buf_extend(dev, pos);
+        percpu_up_read(&dev->trunc_sem);
+
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        if (fault_in_iov_iter_readable(from, chunk - n) == chunk - n) {
+            ret = -EFAULT;
+            goto out;
+        }
+        percpu_down_read(&dev->trunc_sem);
+    }
+
+    if (copied)
+        m_buf_extend(dev, pos);
+    percpu_up_read(&dev->trunc_sem);
+
+out:
+    if (!copied)
+        return ret;
+
+    iocb->ki_pos = pos;
+    return copied;
+}
+
+/* SEEK_SET/CUR/END, SEEK_END is relative to the valid data, not the capacity */
+static loff_t m_llseek(struct file *filp, loff_t offset, int whence)
+{
+    struct m_chdev *dev = m_dev(filp);
+
+    /* Only the buffer has positions, the rings are FIFOs */
+    if (mode != M_MODE_BUFFER)
+        return -ESPIPE;
+
+    return generic_file_llseek_size(filp, offset, whence, dev->capacity, m_buf_size(dev));
+}
+
+/* O_NONBLOCK and IOCB_NOWAIT (RWF_NOWAIT, io_uring) both mean "do not sleep" */
+static bool m_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/* IOCB_NOWAIT must not sleep on the mutex either */
+static int m_lock(struct m_chdev *dev, struct kiocb *iocb)
+{
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return mutex_trylock(&dev->lock) ? 0 : -EAGAIN;
+
+    return mutex_lock_interruptible(&dev->lock) ? -ERESTARTSYS : 0;
+}
+
+/* Wait until the ring has data, return with dev->lock held */
+static int m_stream_wait_data(struct m_chdev *dev, struct kiocb *iocb)
+{
+    struct circ_buf *ring = &dev->ring;
+    int ret;
+
+    ret = m_lock(dev, iocb);
+    if (ret)
+        return ret;
+
+    while (!CIRC_CNT(ring->head, ring->tail, dev->ring_size)) {
+        mutex_unlock(&dev->lock);
+
+        if (m_nowait(iocb))
+            return -EAGAIN;
+
+        if (wait_event_interruptible(dev->read_wq,
+                CIRC_CNT(READ_ONCE(ring->head), READ_ONCE(ring->tail), dev->ring_size)))
+            return -ERESTARTSYS;
+
+        ret = m_lock(dev, iocb);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* Wait until the ring has free space, return with dev->lock held */
+static int m_stream_wait_space(struct m_chdev *dev, struct kiocb *iocb)
+{
+    struct circ_buf *ring = &dev->ring;
+    int ret;
+
+    ret = m_lock(dev, iocb);
+    if (ret)
+        return ret;
+
+    while (!CIRC_SPACE(ring->head, ring->tail, dev->ring_size)) {
+        mutex_unlock(&dev->lock);
+
+        if (m_nowait(iocb))
+            return -EAGAIN;
+
+        if (wait_event_interruptible(dev->write_wq,
+                CIRC_SPACE(READ_ONCE(ring->head), READ_ONCE(ring->tail), dev->ring_size)))
+            return -ERESTARTSYS;
+
+        ret = m_lock(dev, iocb);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* Copy out of the ring with dev->lock held, unlock and wake up writers */
+static ssize_t m_ring_read_unlock(struct m_chdev *dev, struct iov_iter *to)
+{
+    struct circ_buf *ring = &dev->ring;
+    size_t copied = 0;
+    size_t chunk, n;
+    int ret = 0;
+
+    /* At most two chunks: up to the end of the buffer, then from the start */
+    while (iov_iter_count(to)) {
+        chunk = CIRC_CNT_TO_END(ring->head, ring->tail, dev->ring_size);
+        chunk = min(chunk, iov_iter_count(to));
+        if (!chunk)
+            break;
+
+        n = copy_to_iter(ring->buf + ring->tail, chunk, to);
+        ring->tail = (ring->tail + n) & (dev->ring_size - 1);
+        copied += n;
+        if (n != chunk) {
+            ret = -EFAULT;
+            break;
+        }
+    }
+    mutex_unlock(&dev->lock);
+
+    if (copied)
+        wake_up_interruptible(&dev->write_wq);
+
+    return copied ? copied : ret;
+}
+
+/* Drain as much as the iterator holds, blocks only while the ring is empty */
+static ssize_t m_stream_read(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *to)
+{
+    int ret;
+
+    if (!iov_iter_count(to))
+        return 0;
+
+    ret = m_stream_wait_data(dev, iocb);
+    if (ret)
+        return ret;
+
+    return m_ring_read_unlock(dev, to);
+}
+
+/* Queue what fits, like a pipe a full ring gives a short write */
+static ssize_t m_stream_write(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+    struct circ_buf *ring = &dev->ring;
+    size_t copied = 0;
+    size_t chunk, n;
+    int ret;
+
+    if (!iov_iter_count(from))
+        return 0;
+
+    ret = m_stream_wait_space(dev, iocb);
+    if (ret)
+        return ret;
+
+    while (iov_iter_count(from)) {
+        chunk = CIRC_SPACE_TO_END(ring->head, ring->tail, dev->ring_size);
+        chunk = min(chunk, iov_iter_count(from));
+        if (!chunk)
+            break;
+
+        n = copy_from_iter(ring->buf + ring->head, chunk, from);
+        ring->head = (ring->head + n) & (dev->ring_size - 1);
+        copied += n;
+        if (n != chunk) {
+            ret = -EFAULT;
+            break;
+        }
+    }
+    mutex_unlock(&dev->lock);
+
+    if (copied)
+        wake_up_interruptible(&dev->read_wq);
+
+    return copied ? copied : ret;
+}
+
+/* Record header plus payload, padded so the next header stays aligned */
+static size_t m_rec_size(size_t len)
+{
+    return sizeof(struct m_rec) + ALIGN(len, M_REC_ALIGN);
+}
+
+static const struct m_rec *m_pcpu_head(const struct m_pcpu *pc)
+{
+    return (const struct m_rec *)(pc->drain + pc->drain_off);
+}
+
+/* Anything a reader could get, read locklessly for poll() and wait conditions */
+static bool m_pcpu_pending(struct m_chdev *dev)
+{
+    struct m_pcpu *pc;
+    int cpu;
+
+    if (CIRC_CNT(READ_ONCE(dev->ring.head), READ_ONCE(dev->ring.tail), dev->ring_size))
+        return true;
+
+    for_each_possible_cpu(cpu) {
+        pc = per_cpu_ptr(dev->pcpu, cpu);
+        if (READ_ONCE(pc->len) || READ_ONCE(pc->drain_off) != READ_ONCE(pc->drain_len))
+            return true;
+    }
+
+    return false;
+}
+
+static void m_ring_put(struct m_chdev *dev, const void *src, size_t len)
+{
+    struct circ_buf *ring = &dev->ring;
+    size_t chunk = min_t(size_t, len, dev->ring_size - ring->head);
+
+    memcpy(ring->buf + ring->head, src, chunk);
+    memcpy(ring->buf, src + chunk, len - chunk);
+    ring->head = (ring->head + len) & (dev->ring_size - 1);
+}
+
+/*
+ * Merge the per-CPU buffers into the ring, oldest record first, with
+ * dev->lock held. Records of one CPU are already in timestamp order, so this
+ * is a k-way merge on the head of each drain buffer. Whatever does not fit in
+ * the ring stays in the drain buffers for the next merge.
+ */
+static void m_pcpu_merge(struct m_chdev *dev)
+{
+    struct circ_buf *ring = &dev->ring;
+    struct m_pcpu *pc, *oldest;
+    const struct m_rec *rec;
+    size_t moved = 0;
+    size_t size;
+    char *tmp;
+    int cpu;
+
+    /* Take what the writers queued, an O(1) swap under each CPU's lock */
+    for_each_possible_cpu(cpu) {
+        pc = per_cpu_ptr(dev->pcpu, cpu);
+        if (pc->drain_off != pc->drain_len || !READ_ONCE(pc->len))
+            continue;
+
+        mutex_lock(&pc->lock);
+        tmp = pc->drain;
+        pc->drain = pc->buf;
+        pc->buf = tmp;
+        WRITE_ONCE(pc->drain_len, pc->len);
+        WRITE_ONCE(pc->drain_off, 0);
+        WRITE_ONCE(pc->len, 0);
+        mutex_unlock(&pc->lock);
+    }
+
+    for (;;) {
+        oldest = NULL;
+        for_each_possible_cpu(cpu) {
+            pc = per_cpu_ptr(dev->pcpu, cpu);
+            if (pc->drain_off == pc->drain_len)
+                continue;
+            if (!oldest || m_pcpu_head(pc)->ts_ns < m_pcpu_head(oldest)->ts_ns)
+                oldest = pc;
+        }
+        if (!oldest)
+            break;
+
+        rec = m_pcpu_head(oldest);
+        size = m_rec_size(rec->len);
+        if (CIRC_SPACE(ring->head, ring->tail, dev->ring_size) < size)
+            break;
+
+        m_ring_put(dev, rec, size);
+        WRITE_ONCE(oldest->drain_off, oldest->drain_off + size);
+        moved += size;
+    }
+
+    /* Drain buffers that became empty can take the next swap, writers may go on */
+    if (moved)
+        wake_up_interruptible(&dev->write_wq);
+}
+
+/* Per-CPU log: read merges first, then behaves like the streaming ring */
+static ssize_t m_pcpu_read(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *to)
+{
+    int ret;
+
+    if (!iov_iter_count(to))
+        return 0;
+
+    for (;;) {
+        ret = m_lock(dev, iocb);
+        if (ret)
+            return ret;
+
+        m_pcpu_merge(dev);
+        if (CIRC_CNT(dev->ring.head, dev->ring.tail, dev->ring_size))
+            break;
+        mutex_unlock(&dev->lock);
+
+        if (m_nowait(iocb))
+            return -EAGAIN;
+
+        if (wait_event_interruptible(dev->read_wq, m_pcpu_pending(dev)))
+            return -ERESTARTSYS;
+    }
+
+    return m_ring_read_unlock(dev, to);
+}
+
+/*
+ * One write() is one record, appended to the buffer of the current CPU with
+ * only that CPU's lock held. A full buffer is merged by the writer itself,
+ * after any reader that is merging; if the ring is full too, the writer waits
+ * for readers to make room.
+ */
+static ssize_t m_pcpu_write(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+    size_t len = iov_iter_count(from);
+    size_t size = m_rec_size(len);
+    struct m_pcpu *pc;
+    struct m_rec *rec;
+    size_t n;
+
+    if (!len)
+        return 0;
+    if (size > pcpu_size)
+        return -EMSGSIZE;
+
+    for (;;) {
+        /* Migrating after this point is fine, the lock still protects pc */
+        pc = raw_cpu_ptr(dev->pcpu);
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            if (!mutex_trylock(&pc->lock))
+                return -EAGAIN;
+        } else {
+            mutex_lock(&pc->lock);
+        }
+
+        if (pc->len + size <= pcpu_size)
+            break;
+        mutex_unlock(&pc->lock);
+
+        /*
+         * Wait for a reader holding dev->lock rather than retry: with our
+         * drain buffer empty, the wait below would return at once.
+         */
+        if (m_nowait(iocb)) {
+            if (!mutex_trylock(&dev->lock))
+                return -EAGAIN;
+        } else if (mutex_lock_interruptible(&dev->lock)) {
+            return -ERESTARTSYS;
+        }
+        m_pcpu_merge(dev);
+        mutex_unlock(&dev->lock);
+        if (READ_ONCE(pc->len) + size <= pcpu_size)
+            continue;
+
+        if (m_nowait(iocb))
+            return -EAGAIN;
+
+        /* The ring is full, readers empty the drain buffer for the next swap */
+        if (wait_event_interruptible(dev->write_wq,
+                READ_ONCE(pc->len) + size <= pcpu_size ||
+                READ_ONCE(pc->drain_off) == READ_ONCE(pc->drain_len)))
+            return -ERESTARTSYS;
+    }
+
+    /* Timestamp under the lock, so one CPU's records are in order */
+    rec = (struct m_rec *)(pc->buf + pc->len);
+    rec->ts_ns = ktime_get_ns();
+    rec->seq = pc->seq;
+    rec->len = len;
+    rec->cpu = pc->cpu;
+
+    n = copy_from_iter(rec + 1, len, from);
+    if (n != len) {
+        iov_iter_revert(from, n);
+        mutex_unlock(&pc->lock);
+        return -EFAULT;
+    }
+    memset((char *)(rec + 1) + len, 0, size - sizeof(*rec) - len);
+
+    pc->seq++;
+    WRITE_ONCE(pc->len, pc->len + size);
+    mutex_unlock(&pc->lock);
+
+    /* Lockless check first, most writes have nobody to wake */
+    if (wq_has_sleeper(&dev->read_wq))
+        wake_up_interruptible(&dev->read_wq);
+
+    return len;
+}
+
+/* Ring helpers for record mode, dev->lock held. Each one advances head or tail */
+static void m_ring_get(struct m_chdev *dev, void *dst, size_t len)
+{
+    struct circ_buf *ring = &dev->ring;
+    size_t chunk = min_t(size_t, len, dev->ring_size - ring->tail);
+
+    memcpy(dst, ring->buf + ring->tail, chunk);
+    memcpy(dst + chunk, ring->buf, len - chunk);
+    ring->tail = (ring->tail + len) & (dev->ring_size - 1);
+}
+
+static size_t m_ring_to_iter(struct m_chdev *dev, size_t len, struct iov_iter *to)
+{
+    struct circ_buf *ring = &dev->ring;
+    size_t chunk = min_t(size_t, len, dev->ring_size - ring->tail);
+    size_t n;
+
+    n = copy_to_iter(ring->buf + ring->tail, chunk, to);
+    if (n == chunk && len > chunk)
+        n += copy_to_iter(ring->buf, len - chunk, to);
+    ring->tail = (ring->tail + n) & (dev->ring_size - 1);
+    return n;
+}
+
+static size_t m_ring_from_iter(struct m_chdev *dev, size_t len, struct iov_iter *from)
+{
+    struct circ_buf *ring = &dev->ring;
+    size_t chunk = min_t(size_t, len, dev->ring_size - ring->head);
+    size_t n;
+
+    n = copy_from_iter(ring->buf + ring->head, chunk, from);
+    if (n == chunk && len > chunk)
+        n += copy_from_iter(ring->buf, len - chunk, from);
+    ring->head = (ring->head + n) & (dev->ring_size - 1);
+    return n;
+}
+
+/* Length of the oldest record, the ring must not be empty */
+static u32 m_rec_peek(struct m_chdev *dev)
+{
+    int tail = dev->ring.tail;
+    u32 len;
+
+    m_ring_get(dev, &len, sizeof(len));
+    dev->ring.tail = tail;
+    return len;
+}
+
+static bool m_rec_has_room(struct m_chdev *dev, size_t need)
+{
+    return READ_ONCE(dev->nr_recs) < rec_depth &&
+           CIRC_SPACE(READ_ONCE(dev->ring.head), READ_ONCE(dev->ring.tail), dev->ring_size) >= need;
+}
+
+static void m_rec_drop(struct m_chdev *dev)
+{
+    u32 len;
+
+    m_ring_get(dev, &len, sizeof(len));
+    dev->ring.tail = (dev->ring.tail + len) & (dev->ring_size - 1);
+    WRITE_ONCE(dev->nr_recs, dev->nr_recs - 1);
+    this_cpu_inc(dev->stats->drops);
+}
+
+/*
+ * Return the oldest record, or with M_REC_MULTI as many whole records as fit,
+ * each behind its u32 length. A buffer too small for the next record gets
+ * -EMSGSIZE and the record stays queued, FIONREAD tells its length.
+ */
+static ssize_t m_rec_read(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *to)
+{
+    struct m_file *mf = iocb->ki_filp->private_data;
+    bool multi = mf->rec_flags & M_REC_MULTI;
+    size_t copied = 0;
+    size_t need;
+    int tail, ret;
+    bool ok;
+    u32 len;
+
+    if (!iov_iter_count(to))
+        return 0;
+
+    ret = m_stream_wait_data(dev, iocb);
+    if (ret)
+        return ret;
+
+    while (dev->nr_recs) {
+        len = m_rec_peek(dev);
+        need = multi ? sizeof(len) + len : len;
+        if (iov_iter_count(to) < need) {
+            ret = -EMSGSIZE;
+            break;
+        }
+
+        /* A fault leaves the record queued */
+        tail = dev->ring.tail;
+        if (multi) {
+            ok = m_ring_to_iter(dev, sizeof(len), to) == sizeof(len);
+        } else {
+            dev->ring.tail = (tail + sizeof(len)) & (dev->ring_size - 1);
+            ok = true;
+        }
+        if (!ok || m_ring_to_iter(dev, len, to) != len) {
+            dev->ring.tail = tail;
+            ret = -EFAULT;
+            break;
+        }
+
+        WRITE_ONCE(dev->nr_recs, dev->nr_recs - 1);
+        copied += need;
+        if (!multi)
+            break;
+    }
+    mutex_unlock(&dev->lock);
+
+    if (copied)
+        wake_up_interruptible(&dev->write_wq);
+
+    return copied ? copied : ret;
+}
+
+/* One write() is one record, never split and never merged with another */
+static ssize_t m_rec_write(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+    size_t len = iov_iter_count(from);
+    size_t need = sizeof(u32) + len;
+    u32 hdr = len;
+    int head, ret;
+
+    if (!len)
+        return 0;
+    /* One slot of the ring is always kept free */
+    if (need > dev->ring_size - 1)
+        return -EMSGSIZE;
+
+    ret = m_lock(dev, iocb);
+    if (ret)
+        return ret;
+
+    while (!m_rec_has_room(dev, need)) {
+        if (rec_policy == M_REC_DROP_OLDEST) {
+            m_rec_drop(dev);
+            continue;
+        }
+        mutex_unlock(&dev->lock);
+
+        if (m_nowait(iocb))
+            return -EAGAIN;
+
+        if (wait_event_interruptible(dev->write_wq, m_rec_has_room(dev, need)))
+            return -ERESTARTSYS;
+
+        ret = m_lock(dev, iocb);
+        if (ret)
+            return ret;
+    }
+
+    /* Readers only see the record once nr_recs counts it */
+    head = dev->ring.head;
+    m_ring_put(dev, &hdr, sizeof(hdr));
+    if (m_ring_from_iter(dev, len, from) != len) {
+        dev->ring.head = head;
+        mutex_unlock(&dev->lock);
+        return -EFAULT;
+    }
+    WRITE_ONCE(dev->nr_recs, dev->nr_recs + 1);
+    mutex_unlock(&dev->lock);
+
+    wake_up_interruptible(&dev->read_wq);
+    return len;
+}
+
+/*
+ * Broadcast: one writer at a time (dev->lock), it overwrites the oldest data
+ * without looking at readers. At most one ring is taken, like a short write.
+ */
+static ssize_t m_bcast_write(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+    size_t len = min_t(size_t, iov_iter_count(from), dev->ring_size);
+    unsigned long head;
+    size_t off, chunk, n;
+    int ret;
+
+    if (!len)
+        return 0;
+
+    ret = m_lock(dev, iocb);
+    if (ret)
+        return ret;
+
+    /* Readers copying what we are about to overwrite will see it changed */
+    head = dev->bc_head;
+    WRITE_ONCE(dev->bc_start, head + len);
+    smp_wmb();
+
+    off = head & (dev->ring_size - 1);
+    chunk = min_t(size_t, len, dev->ring_size - off);
+    n = copy_from_iter(dev->ring.buf + off, chunk, from);
+    if (n == chunk && len > chunk)
+        n += copy_from_iter(dev->ring.buf, len - chunk, from);
+
+    smp_store_release(&dev->bc_head, head + n);
+    mutex_unlock(&dev->lock);
+
+    if (!n)
+        return -EFAULT;
+
+    if (wq_has_sleeper(&dev->read_wq))
+        wake_up_interruptible(&dev->read_wq);
+    return n;
+}
+
+/*
+ * Lockless against the writer: copy optimistically from the cursor, then
+ * check that the writer did not start overwriting what was copied. A reader
+ * that fell more than a ring behind gets -EOVERFLOW once and continues from
+ * the oldest data still in the ring.
+ */
+static ssize_t m_bcast_read(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *to)
+{
+    struct m_file *mf = iocb->ki_filp->private_data;
+    unsigned long head, cursor;
+    size_t len, off, chunk, n;
+    ssize_t ret;
+
+    if (!iov_iter_count(to))
+        return 0;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!mutex_trylock(&mf->read_lock))
+            return -EAGAIN;
+    } else if (mutex_lock_interruptible(&mf->read_lock)) {
+        return -ERESTARTSYS;
+    }
+
+    cursor = mf->cursor;
+    for (;;) {
+        head = smp_load_acquire(&dev->bc_head);
+        if (head != cursor)
+            break;
+
+        ret = -EAGAIN;
+        if (m_nowait(iocb))
+            goto out;
+        ret = -ERESTARTSYS;
+        if (wait_event_interruptible(dev->read_wq,
+                smp_load_acquire(&dev->bc_head) != cursor))
+            goto out;
+    }
+
+    if (head - cursor > dev->ring_size)
+        goto overrun;
+
+    len = min_t(size_t, iov_iter_count(to), head - cursor);
+    off = cursor & (dev->ring_size - 1);
+    chunk = min_t(size_t, len, dev->ring_size - off);
+    n = copy_to_iter(dev->ring.buf + off, chunk, to);
+    if (n == chunk && len > chunk)
+        n += copy_to_iter(dev->ring.buf, len - chunk, to);
+
+    /* Pairs with smp_wmb() in m_bcast_write(), bc_start moves before the data */
+    smp_rmb();
+    if (READ_ONCE(dev->bc_start) - cursor > dev->ring_size)
+        goto overrun;
+
+    ret = -EFAULT;
+    if (!n)
+        goto out;
+
+    mf->cursor = cursor + n;
+    ret = n;
+    goto out;
+
+overrun:
+    this_cpu_inc(dev->stats->overruns);
+    mf->cursor = READ_ONCE(dev->bc_start) - dev->ring_size;
+    ret = -EOVERFLOW;
+out:
+    mutex_unlock(&mf->read_lock);
+    return ret;
+}
+
+static ssize_t m_do_read(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *to)
+{
+    if (mode == M_MODE_STREAM)
+        return m_stream_read(dev, iocb, to);
+    if (mode == M_MODE_PERCPU)
+        return m_pcpu_read(dev, iocb, to);
+    if (mode == M_MODE_RECORD)
+        return m_rec_read(dev, iocb, to);
+    if (mode == M_MODE_BCAST)
+        return m_bcast_read(dev, iocb, to);
+    /* The shared-memory ring is only accessed through its mapping */
+    if (mode == M_MODE_SHM)
+        return -EINVAL;
+
+    return m_buf_read(dev, iocb, to);
+}
+static ssize_t m_do_write(struct m_chdev *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+    if (mode == M_MODE_STREAM)
+        return m_stream_write(dev, iocb, from);
+    if (mode == M_MODE_PERCPU)
+        return m_pcpu_write(dev, iocb, from);
+    if (mode == M_MODE_RECORD)
+        return m_rec_write(dev, iocb, from);
+    if (mode == M_MODE_BCAST)
+        return m_bcast_write(dev, iocb, from);
+    if (mode == M_MODE_SHM)
+        return -EINVAL;
+
+    return m_buf_write(dev, iocb, from);
+}
+
+static ssize_t m_read_iter(struct kiocb *iocb, struct iov_iter *to){
+    struct m_chdev *dev = m_dev(iocb->ki_filp);
+    size_t count = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    u64 start = m_lat_start();
+    ssize_t ret;
+
+    ret = m_do_read(dev, iocb, to);
+
+    m_stats_account(dev, M_OP_READ, count, ret, start);
+    trace_m_read(MINOR(dev->dev_num), pos, count, ret);
+    return ret;
+}
+static ssize_t m_write_iter(struct kiocb *iocb, struct iov_iter *from){
+    struct m_chdev *dev = m_dev(iocb->ki_filp);
+    size_t count = iov_iter_count(from);
+    loff_t pos = iocb->ki_pos;
+    u64 start = m_lat_start();
+    ssize_t ret;
+
+    ret = m_do_write(dev, iocb, from);
+
+    m_stats_account(dev, M_OP_WRITE, count, ret, start);
+    trace_m_write(MINOR(dev->dev_num), pos, count, ret);
+    return ret;
+}
+
+/*
+ * Pages are mapped lazily, one per fault. The extra reference taken here is
+ * dropped by the mm when the page is unmapped, so the buffer page can never
+ * be freed underneath a mapping.
+ */
+static vm_fault_t m_vm_fault(struct vm_fault *vmf)
+{
+    struct m_chdev *dev = vmf->vma->vm_private_data;
+    unsigned long offset = vmf->pgoff << PAGE_SHIFT;
+    struct page *page;
+
+    if (mode == M_MODE_SHM) {
+        if (offset >= dev->buf_len)
+            return VM_FAULT_SIGBUS;
+
+        page = virt_to_page(dev->buf_ptr + offset);
+        get_page(page);
+        vmf->page = page;
+        return 0;
+    }
+
+    if (offset >= dev->capacity)
+        return VM_FAULT_SIGBUS;
+
+    /*
+     * A hole gets its page here, m_buf_get_page() already took our reference.
+     * Like a writer, it must not bring back a page a truncate is freeing.
+     */
+    percpu_down_read(&dev->trunc_sem);
+    page = m_buf_get_page(dev, vmf->pgoff);
+    percpu_up_read(&dev->trunc_sem);
+    if (IS_ERR(page))
+        return vmf_error(PTR_ERR(page));
+
+    vmf->page = page;
+    return 0;
+}
+
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+/*
+ * buf_order >= PMD_ORDER: map a whole folio with one PMD, one TLB entry
+ * instead of 512. thp_get_unmapped_area() aligns the mapping so that the
+ * core mm asks for it. Anything else falls back to m_vm_fault().
+ */
+static vm_fault_t m_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct m_chdev *dev = vma->vm_private_data;
+    unsigned long haddr = vmf->address & HPAGE_PMD_MASK;
+    pgoff_t base = round_down(vmf->pgoff, HPAGE_PMD_NR);
+    struct folio *folio;
+    struct page *page;
+    vm_fault_t ret;
+
+    if (mode != M_MODE_BUFFER || order != PMD_ORDER || dev->order < PMD_ORDER)
+        return VM_FAULT_FALLBACK;
+    /*
+     * The core mm leaves these to us: the PMD must lie inside the VMA, and
+     * a MAP_FIXED address aligned unlike pgoff would put the wrong pages of
+     * the folio at each address.
+     */
+    if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+        return VM_FAULT_FALLBACK;
+    if (((vmf->address >> PAGE_SHIFT) - vmf->pgoff) & (HPAGE_PMD_NR - 1))
+        return VM_FAULT_FALLBACK;
+    if (((loff_t)(base + HPAGE_PMD_NR) << PAGE_SHIFT) > dev->capacity)
+        return VM_FAULT_FALLBACK;
+
+    percpu_down_read(&dev->trunc_sem);
+    page = m_buf_get_page(dev, base);
+    if (IS_ERR(page)) {
+        percpu_up_read(&dev->trunc_sem);
+        return VM_FAULT_FALLBACK;
+    }
+
+    /* An order-0 fallback page, or part of a bigger folio, is not PMD mappable */
+    folio = page_folio(page);
+    if (folio_order(folio) != PMD_ORDER) {
+        percpu_up_read(&dev->trunc_sem);
+        folio_put(folio);
+        return VM_FAULT_FALLBACK;
+    }
+
+    /* Takes its own reference for the mapping */
+    ret = vmf_insert_folio_pmd(vmf, folio, vmf->flags & FAULT_FLAG_WRITE);
+    percpu_up_read(&dev->trunc_sem);
+    folio_put(folio);
+    return ret;
+}
+#endif
+
+static const struct vm_operations_struct m_vm_ops = {
+    .fault = m_vm_fault,
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+    .huge_fault = m_vm_huge_fault,
+#endif
+};
+
+static int m_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct m_chdev *dev = m_dev(filp);
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long limit;
+
+    /* The ring wraps around, there is nothing sensible to map */
+    if (m_ring_mode())
+        return -ENODEV;
+
+    /* Mapping must stay inside the buffer */
+    limit = mode == M_MODE_SHM ? dev->buf_len : dev->capacity;
+    if (offset >= limit || len > limit - offset)
+        return -EINVAL;
+
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_ops = &m_vm_ops;
+    vma->vm_private_data = dev;
+
+    return 0;
+}
+
+/* Bytes published by the producer and not consumed yet */
+static u32 m_shm_count(struct m_chdev *dev)
+{
+    return smp_load_acquire(&dev->shm->head) - smp_load_acquire(&dev->shm->tail);
+}
+
+/* User space owns head/tail, a bogus count must not be trusted as free space */
+static bool m_shm_has_space(struct m_chdev *dev)
+{
+    return m_shm_count(dev) < dev->ring_size;
+}
+
+static int m_shm_wait(struct m_chdev *dev, struct file *filp, unsigned long what)
+{
+    if (what & ~(unsigned long)(M_SHM_WAIT_DATA | M_SHM_WAIT_SPACE) || !what)
+        return -EINVAL;
+
+    if (what & M_SHM_WAIT_DATA) {
+        if (!m_shm_count(dev) && (filp->f_flags & O_NONBLOCK))
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->read_wq, m_shm_count(dev)))
+            return -ERESTARTSYS;
+    }
+
+    if (what & M_SHM_WAIT_SPACE) {
+        if (!m_shm_has_space(dev) && (filp->f_flags & O_NONBLOCK))
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->write_wq, m_shm_has_space(dev)))
+            return -ERESTARTSYS;
+    }
+
+    return 0;
+}
+
+/* One entry through the normal read/write path, stats and trace points included */
+static ssize_t m_batch_one(struct file *filp, const struct m_batch_ent *ent)
+{
+    struct kiocb kiocb;
+    struct iov_iter iter;
+    int ret;
+
+    if (ent->op == M_BATCH_READ && !(filp->f_mode & FMODE_READ))
+        return -EBADF;
+    if (ent->op == M_BATCH_WRITE && !(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (ent->op != M_BATCH_READ && ent->op != M_BATCH_WRITE)
+        return -EINVAL;
+    if ((loff_t)ent->offset < 0)
+        return -EINVAL;
+
+    ret = import_ubuf(ent->op == M_BATCH_READ ? ITER_DEST : ITER_SOURCE,
+                      u64_to_user_ptr(ent->buf), ent->len, &iter);
+    if (ret)
+        return ret;
+
+    init_sync_kiocb(&kiocb, filp);
+    kiocb.ki_pos = ent->offset;
+
+    if (ent->op == M_BATCH_READ)
+        return m_read_iter(&kiocb, &iter);
+    return m_write_iter(&kiocb, &iter);
+}
+
+/*
+ * Descriptors are copied in once, results go back one by one so a signal or
+ * fault half way still leaves the finished entries reported.
+ */
+static long m_batch(struct file *filp, struct m_batch __user *argp)
+{
+    struct m_batch_ent __user *uents;
+    struct m_batch_ent *ents;
+    struct m_batch batch;
+    ssize_t res = 0;
+    long done;
+
+    if (copy_from_user(&batch, argp, sizeof(batch)))
+        return -EFAULT;
+    if (batch.flags & ~M_BATCH_CONTINUE)
+        return -EINVAL;
+    if (!batch.nr)
+        return 0;
+    if (batch.nr > M_BATCH_MAX)
+        return -E2BIG;
+
+    uents = u64_to_user_ptr(batch.ents);
+    ents = memdup_array_user(uents, batch.nr, sizeof(*ents));
+    if (IS_ERR(ents))
+        return PTR_ERR(ents);
+
+    for (done = 0; done < batch.nr; done++) {
+        res = m_batch_one(filp, &ents[done]);
+        if (put_user((s64)res, &uents[done].result)) {
+            res = -EFAULT;
+            break;
+        }
+        if (res < 0 && !(batch.flags & M_BATCH_CONTINUE)) {
+            done++;
+            break;
+        }
+        if (fatal_signal_pending(current)) {
+            done++;
+            break;
+        }
+    }
+    kfree(ents);
+
+    /* Nothing reported at all, fail like the syscall would have */
+    if (!done)
+        return res;
+    return done;
+}
+
+static long m_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct m_file *mf = filp->private_data;
+    struct m_chdev *dev = mf->dev;
+    u64 __user *argp = (u64 __user *)arg;
+    u32 flags;
+    u64 val;
+
+    switch (cmd) {
+    case M_IOC_GET_SIZE:
+        /* Broadcast: what this file has not read yet, at most one ring */
+        if (mode == M_MODE_BCAST)
+            return put_user((u64)min_t(unsigned long, dev->ring_size,
+                            smp_load_acquire(&dev->bc_head) - mf->cursor), argp);
+        /* Streaming mode: bytes queued and not read yet (merged ones in per-CPU mode) */
+        if (mode == M_MODE_STREAM || mode == M_MODE_PERCPU || mode == M_MODE_RECORD)
+            return put_user((u64)CIRC_CNT(READ_ONCE(dev->ring.head),
+                                          READ_ONCE(dev->ring.tail), dev->ring_size), argp);
+        if (mode == M_MODE_SHM)
+            return put_user((u64)m_shm_count(dev), argp);
+        return put_user((u64)m_buf_size(dev), argp);
+
+    case M_IOC_SET_SIZE:
+        if (mode != M_MODE_BUFFER)
+            return -EINVAL;
+        /* Producer wrote through mmap, tell read() how much is valid.
+         * A smaller size truncates and frees the pages past the end. */
+        if (get_user(val, argp))
+            return -EFAULT;
+        if (val > dev->capacity)
+            return -EINVAL;
+        return m_buf_truncate(dev, filp->f_mapping, val);
+
+    case M_IOC_GET_CAPACITY:
+        /* One slot is kept free to tell a full ring from an empty one */
+        if (mode == M_MODE_STREAM || mode == M_MODE_PERCPU || mode == M_MODE_RECORD)
+            return put_user((u64)(dev->ring_size - 1), argp);
+        if (mode == M_MODE_SHM || mode == M_MODE_BCAST)
+            return put_user((u64)dev->ring_size, argp);
+        return put_user((u64)dev->capacity, argp);
+
+    case M_IOC_SHM_WAIT:
+        if (mode != M_MODE_SHM)
+            return -EINVAL;
+        return m_shm_wait(dev, filp, arg);
+
+    case M_IOC_SHM_WAKE:
+        if (mode != M_MODE_SHM)
+            return -EINVAL;
+        wake_up_interruptible(&dev->read_wq);
+        wake_up_interruptible(&dev->write_wq);
+        return 0;
+
+    case FIONREAD:
+        if (mode != M_MODE_RECORD)
+            return -ENOTTY;
+        /* Like a datagram socket: length of the next record, 0 if none */
+        if (mutex_lock_interruptible(&dev->lock))
+            return -ERESTARTSYS;
+        val = dev->nr_recs ? m_rec_peek(dev) : 0;
+        mutex_unlock(&dev->lock);
+        return put_user((int)val, (int __user *)arg);
+
+    case M_IOC_SET_REC_FLAGS:
+        if (mode != M_MODE_RECORD)
+            return -EINVAL;
+        if (get_user(flags, (u32 __user *)arg))
+            return -EFAULT;
+        if (flags & ~M_REC_MULTI)
+            return -EINVAL;
+        mf->rec_flags = flags;
+        return 0;
+
+    case M_IOC_BATCH:
+        return m_batch(filp, (struct m_batch __user *)arg);
+
+    case M_IOC_FLUSH:
+        if (mode != M_MODE_PERCPU)
+            return -EINVAL;
+        /* Make everything written so far visible to GET_SIZE and non-blocking reads */
+        if (mutex_lock_interruptible(&dev->lock))
+            return -ERESTARTSYS;
+        m_pcpu_merge(dev);
+        mutex_unlock(&dev->lock);
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+static __poll_t m_poll(struct file *filp, poll_table *wait)
+{
+    struct m_chdev *dev = m_dev(filp);
+    struct circ_buf *ring = &dev->ring;
+    __poll_t mask = 0;
+    int head, tail;
+
+    /* The shared buffer never blocks */
+    if (mode == M_MODE_BUFFER)
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &dev->read_wq, wait);
+    poll_wait(filp, &dev->write_wq, wait);
+
+    /* Writers only block when their own CPU is full, nothing to report here */
+    if (mode == M_MODE_PERCPU) {
+        if (m_pcpu_pending(dev))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        return mask | EPOLLOUT | EPOLLWRNORM;
+    }
+
+    /* Writers never wait in broadcast mode */
+    if (mode == M_MODE_BCAST) {
+        struct m_file *mf = filp->private_data;
+
+        if (smp_load_acquire(&dev->bc_head) != READ_ONCE(mf->cursor))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        return mask | EPOLLOUT | EPOLLWRNORM;
+    }
+
+    if (mode == M_MODE_RECORD) {
+        if (READ_ONCE(dev->nr_recs))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        /* A drop-oldest queue always takes a write */
+        if (rec_policy == M_REC_DROP_OLDEST || m_rec_has_room(dev, sizeof(u32) + 1))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        return mask;
+    }
+
+    if (mode == M_MODE_SHM) {
+        if (m_shm_count(dev))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (m_shm_has_space(dev))
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        return mask;
+    }
+
+    head = READ_ONCE(ring->head);
+    tail = READ_ONCE(ring->tail);
+    if (CIRC_CNT(head, tail, dev->ring_size))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (CIRC_SPACE(head, tail, dev->ring_size))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
 module_init(chdev_init);
 module_exit(chdev_exit);
 
@@ -0,0 +1,131 @@
+/*
+ * ioctl interface of /dev/m_device, shared between the driver (exam.c)
+ * and user space programs.
+ */
+#ifndef _M_IOCTL_H
+#define _M_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define M_IOC_MAGIC         'm'
+
+/* Number of valid bytes in the buffer (what read() returns, what mmap users share) */
+#define M_IOC_GET_SIZE      _IOR(M_IOC_MAGIC, 1, __u64)
+#define M_IOC_SET_SIZE      _IOW(M_IOC_MAGIC, 2, __u64)
+/* Total size of the buffer, also the largest length that can be mmap'd */
+#define M_IOC_GET_CAPACITY  _IOR(M_IOC_MAGIC, 3, __u64)
+
+/*
+ * mode=2: single producer / single consumer ring shared through mmap().
+ *
+ * Offset 0 of the mapping is struct m_shm_ctrl, the data area starts at
+ * ctrl->data_off and is ctrl->ring_size bytes (a power of two). head and tail
+ * are free running byte counters, the data offset of a counter is
+ * (counter & (ring_size - 1)). Only the producer writes head and only the
+ * consumer writes tail, each publishes with a store-release and reads the
+ * other side's counter with a load-acquire.
+ *
+ * No syscall is needed per message. A side that has to sleep sets its
+ * *_waiting flag, issues a full fence, re-checks the ring and then sleeps in
+ * poll() or M_IOC_SHM_WAIT. After publishing, the other side issues a full
+ * fence and calls M_IOC_SHM_WAKE only if the peer's flag is set.
+ */
+struct m_shm_ctrl {
+    __u32 head;                 /* Written by the producer */
+    __u32 producer_waiting;     /* Producer sleeps until there is space */
+    __u32 pad0[14];             /* Keep head and tail on separate cache lines */
+    __u32 tail;                 /* Written by the consumer */
+    __u32 consumer_waiting;     /* Consumer sleeps until there is data */
+    __u32 pad1[14];
+    __u32 ring_size;            /* Read-only for user space */
+    __u32 data_off;             /* Read-only for user space */
+};
+
+#define M_SHM_WAIT_DATA     (1 << 0)
+#define M_SHM_WAIT_SPACE    (1 << 1)
+
+/* Sleep until the ring has data and/or space, arg is M_SHM_WAIT_* by value */
+#define M_IOC_SHM_WAIT      _IO(M_IOC_MAGIC, 4)
+/* Wake up whoever sleeps in M_IOC_SHM_WAIT or poll() */
+#define M_IOC_SHM_WAKE      _IO(M_IOC_MAGIC, 5)
+
+/*
+ * mode=3: every write() becomes one record in the buffer of the CPU it ran
+ * on. read() returns the merged stream: struct m_rec, len bytes of payload,
+ * then padding up to M_REC_ALIGN. The merge emits records oldest first, but
+ * a record can still show up after a newer one merged earlier, sort on
+ * (ts_ns, cpu, seq) to rebuild the exact order. seq counts per CPU.
+ */
+struct m_rec {
+    __u64 ts_ns;                /* CLOCK_MONOTONIC when the record was queued */
+    __u64 seq;
+    __u32 len;                  /* Payload bytes, without padding */
+    __u32 cpu;
+};
+
+#define M_REC_ALIGN         8
+
+/* Merge the per-CPU buffers into the readable stream now */
+#define M_IOC_FLUSH         _IO(M_IOC_MAGIC, 6)
+
+/*
+ * Many reads/writes in one syscall. Entries run in array order, each like a
+ * pread()/pwrite() at offset (the ring modes ignore offset and behave like
+ * read()/write()), and the file position is not moved. The ioctl returns how
+ * many entries have their result filled in. Without M_BATCH_CONTINUE the
+ * batch stops after the first entry that fails.
+ */
+#define M_BATCH_READ        0
+#define M_BATCH_WRITE       1
+
+struct m_batch_ent {
+    __u64 offset;
+    __u64 buf;                  /* User pointer */
+    __u32 len;
+    __u32 op;                   /* M_BATCH_READ or M_BATCH_WRITE */
+    __s64 result;               /* Filled by the driver: bytes done or -errno */
+};
+
+#define M_BATCH_CONTINUE    (1 << 0)    /* Go on after a failed entry */
+#define M_BATCH_MAX         1024
+
+struct m_batch {
+    __u64 ents;                 /* User pointer to nr struct m_batch_ent */
+    __u32 nr;
+    __u32 flags;
+};
+
+#define M_IOC_BATCH         _IOW(M_IOC_MAGIC, 7, struct m_batch)
+
+/*
+ * mode=4: each write() queues one record, each read() returns the oldest one
+ * (-EMSGSIZE if it does not fit, FIONREAD gives its length). With
+ * M_REC_MULTI set on the file descriptor, read() returns as many whole
+ * records as fit, each behind a __u32 length in host byte order.
+ */
+#define M_REC_MULTI         (1 << 0)
+
+#define M_IOC_SET_REC_FLAGS _IOW(M_IOC_MAGIC, 8, __u32)
+
+/*
+ * mode=5: broadcast. Every open file descriptor reads everything written
+ * after it was opened, through its own cursor. Writers never wait: a reader
+ * that falls more than GET_CAPACITY bytes behind gets -EOVERFLOW from read()
+ * once, then continues with the oldest data still buffered. GET_SIZE is what
+ * this descriptor has not read yet.
+ */
+
+#ifndef __KERNEL__
+static inline __u32 m_shm_load_acquire(const __u32 *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void m_shm_store_release(__u32 *p, __u32 val)
+{
+    __atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
+#endif
+
+#endif /* _M_IOCTL_H */
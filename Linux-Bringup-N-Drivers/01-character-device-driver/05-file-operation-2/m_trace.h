@@ -0,0 +1,86 @@
+/*
+ * Trace events of /dev/m_device, they cost a patched-out branch when disabled.
+ *
+ * echo 1 > /sys/kernel/tracing/events/m_device/enable
+ * perf record -e 'm_device:*' -a
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM m_device
+
+#if !defined(_M_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _M_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(m_open,
+    TP_PROTO(unsigned int minor, unsigned int f_flags),
+    TP_ARGS(minor, f_flags),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, f_flags)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->f_flags = f_flags;
+    ),
+
+    TP_printk("minor=%u f_flags=0x%x", __entry->minor, __entry->f_flags)
+);
+
+TRACE_EVENT(m_release,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+
+    TP_printk("minor=%u", __entry->minor)
+);
+
+DECLARE_EVENT_CLASS(m_rw,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(minor, pos, count, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%u pos=%lld count=%zu ret=%zd",
+              __entry->minor, __entry->pos, __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(m_rw, m_read,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(minor, pos, count, ret)
+);
+
+DEFINE_EVENT(m_rw, m_write,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(minor, pos, count, ret)
+);
+
+#endif /* _M_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE m_trace
+#include <trace/define_trace.h>
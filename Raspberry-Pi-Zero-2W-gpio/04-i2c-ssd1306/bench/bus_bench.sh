@@ -0,0 +1,83 @@
+#!/bin/sh
+# Bytes on the bus per operation of ssd1306-i2c.ko, measured on the emulated
+# panel of ssd1306-emu.ko, no hardware needed (x86 is fine):
+#
+#   make -C .. && sudo ./bus_bench.sh [rounds]
+#
+# Every round writes the case's setup text, resets the emulator's counters,
+# runs the operation and waits for the flush worker with fsync. The average
+# over all rounds is printed as CSV.
+# Compare the output before and after a change to catch batching or
+# dirty-tracking regressions.
+
+set -e
+
+ROUNDS=${1:-20}
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+DBG=/sys/kernel/debug/ssd1306-emu
+PARAM=/sys/module/ssd1306_i2c/parameters
+
+mountpoint -q /sys/kernel/debug || mount -t debugfs none /sys/kernel/debug
+
+rmmod ssd1306_i2c 2>/dev/null || true
+rmmod ssd1306_emu 2>/dev/null || true
+insmod "$DIR/ssd1306-emu.ko"
+insmod "$DIR/ssd1306-i2c.ko" fbdev=0 splash=0
+
+# Async probe: wait for the node
+DEV=
+for i in $(seq 50); do
+    DEV=$(ls /dev/ssd1306-* 2>/dev/null | head -n 1)
+    [ -n "$DEV" ] && break
+    sleep 0.1
+done
+[ -n "$DEV" ] || { echo "no /dev/ssd1306-* after probe" >&2; exit 1; }
+
+# write() returns before the panel is updated, dd conv=fsync waits for the flush
+put() {
+    printf '%b' "$1" | dd of="$DEV" bs=4096 conv=fsync status=none
+}
+
+STATS="xfers bytes cmd_bytes data_bytes bus_us_100khz bus_us_400khz bus_us_1000khz"
+
+# Counters as one line, in the order of $STATS
+stats() {
+    awk -v keys="$STATS" 'BEGIN { n = split(keys, k) } { v[$1] = $2 }
+        END { for (i = 1; i <= n; i++) printf "%s%s", v[k[i]], (i < n ? " " : "\n") }' "$DBG/stats"
+}
+
+# name, terminal mode, setup written before every round (not counted), op
+run() {
+    echo "$2" > "$PARAM/terminal"
+    sum="0 0 0 0 0 0 0"
+    i=0
+    while [ $i -lt "$ROUNDS" ]; do
+        [ -n "$3" ] && put "$3"
+        echo 0 > "$DBG/stats"
+        put "$4"
+        sum=$(echo "$sum $(stats)" | awk '{ for (i = 1; i <= 7; i++) printf "%d%s", $i + $(i + 7), (i < 7 ? " " : "\n") }')
+        i=$((i + 1))
+    done
+    echo "$1 $sum" | awk -v r="$ROUNDS" '{ printf "%s", $1; for (i = 2; i <= 8; i++) printf ",%d", $i / r; printf "\n" }'
+}
+
+FULL="Line 1\nLine 2\nLine 3\nLine 4\nLine 5\nLine 6\nLine 7\nLine 8"
+# FULL with its fifth line rewritten
+EDIT="Line 1\nLine 2\nLine 3\nLine 4\nChanged text\nLine 6\nLine 7\nLine 8"
+
+echo "op,$(echo $STATS | tr ' ' ',')"
+# A full screen of text wiped: write() with a lone newline draws nothing
+run clear 0 "$FULL" "\n"
+# Hello World on an empty screen
+run print_string 0 "\n" "Hello World"
+# Same text again: nothing changed, nothing should go on the bus
+run print_same 0 "Hello World" "Hello World"
+# A full screen redrawn with one line changed: only that page's window goes out
+run line_change 0 "$FULL" "$EDIT"
+# Terminal at the bottom of the screen: one line appended, the screen scrolls
+echo 1 > "$PARAM/terminal"
+put "\n\n\n\n\n\n\n\n\n"
+run line_append 1 "" "log line\n"
+
+rmmod ssd1306_i2c
+rmmod ssd1306_emu
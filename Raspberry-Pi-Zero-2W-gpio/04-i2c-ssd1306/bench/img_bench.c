@@ -0,0 +1,131 @@
+/*
+ * Image conversion benchmark: ssd1306_img_to_pages() (8x8 blocks in 64-bit
+ * words, what the driver runs) against a per-pixel reference.
+ *
+ * Every rotation is checked against the reference on random images first,
+ * then both are timed over -n full frames:
+ *
+ *   ./img_bench -n 100000
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ssd1306_bitmap.h"
+
+static const unsigned int rotations[] = { 0, 90, 180, 270 };
+
+/* Display pixel (x, y) looked up in the source image one bit at a time */
+static int img_pixel(const uint8_t *img, unsigned int rotate, int x, int y)
+{
+    int w, sx, sy;
+
+    switch (rotate) {
+    case 0:   w = SSD1306_IMG_W; sx = x; sy = y; break;
+    case 180: w = SSD1306_IMG_W; sx = SSD1306_IMG_W - 1 - x; sy = SSD1306_IMG_H - 1 - y; break;
+    case 90:  w = SSD1306_IMG_H; sx = y; sy = SSD1306_IMG_W - 1 - x; break;
+    default:  w = SSD1306_IMG_H; sx = SSD1306_IMG_H - 1 - y; sy = x; break;
+    }
+
+    return (img[sy * (w / 8) + sx / 8] >> (7 - sx % 8)) & 1;
+}
+
+static void img_to_pages_ref(uint8_t pages[SSD1306_IMG_PAGES][SSD1306_IMG_W],
+                             const uint8_t *img, unsigned int rotate)
+{
+    int page, x, bit;
+    uint8_t b;
+
+    for (page = 0; page < SSD1306_IMG_PAGES; page++) {
+        for (x = 0; x < SSD1306_IMG_W; x++) {
+            b = 0;
+            for (bit = 0; bit < 8; bit++)
+                b |= img_pixel(img, rotate, x, page * 8 + bit) << bit;
+            pages[page][x] = b;
+        }
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n frames]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t img[SSD1306_IMG_BYTES];
+    static uint8_t fast[SSD1306_IMG_PAGES][SSD1306_IMG_W];
+    static uint8_t ref[SSD1306_IMG_PAGES][SSD1306_IMG_W];
+    long frames = 20000;
+    uint64_t t0, t_fast, t_ref;
+    unsigned int r;
+    int opt, round, ret = 0;
+    size_t i;
+    long n;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            frames = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (frames <= 0)
+        usage(argv[0]);
+
+    srand(1);
+    for (r = 0; r < sizeof(rotations) / sizeof(rotations[0]); r++) {
+        for (round = 0; round < 16; round++) {
+            for (i = 0; i < sizeof(img); i++)
+                img[i] = rand();
+            ssd1306_img_to_pages(fast, img, rotations[r]);
+            img_to_pages_ref(ref, img, rotations[r]);
+            if (memcmp(fast, ref, sizeof(fast))) {
+                fprintf(stderr, "rotate %u: output differs from the reference\n", rotations[r]);
+                ret = 1;
+                break;
+            }
+        }
+    }
+    if (ret)
+        return ret;
+
+    printf("rotate,fast_ns_per_frame,ref_ns_per_frame,speedup\n");
+    for (r = 0; r < sizeof(rotations) / sizeof(rotations[0]); r++) {
+        t0 = now_ns();
+        for (n = 0; n < frames; n++) {
+            img[n % sizeof(img)]++;
+            ssd1306_img_to_pages(fast, img, rotations[r]);
+            __asm__ volatile("" : : "r"(fast) : "memory");
+        }
+        t_fast = now_ns() - t0;
+
+        t0 = now_ns();
+        for (n = 0; n < frames; n++) {
+            img[n % sizeof(img)]++;
+            img_to_pages_ref(ref, img, rotations[r]);
+            __asm__ volatile("" : : "r"(ref) : "memory");
+        }
+        t_ref = now_ns() - t0;
+
+        printf("%u,%.1f,%.1f,%.1f\n", rotations[r], (double)t_fast / frames,
+               (double)t_ref / frames, (double)t_ref / t_fast);
+    }
+
+    return 0;
+}
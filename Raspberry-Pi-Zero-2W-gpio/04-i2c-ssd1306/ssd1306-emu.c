@@ -0,0 +1,342 @@
+/*
+ * Virtual I2C adapter with an emulated SSD1306 at 0x3c, to run and measure
+ * ssd1306-i2c.ko on a machine without the panel:
+ *
+ *   insmod ssd1306-emu.ko && insmod ssd1306-i2c.ko
+ *
+ * The command/data streams are decoded into an emulated GDDRAM and every
+ * transfer is counted. debugfs (/sys/kernel/debug/ssd1306-emu/):
+ *   stats  transactions, bytes and the bus time they take at 100/400/1000 kHz,
+ *          any write resets the counters
+ *   frame  what the panel would show, '#' = pixel on, start line applied
+ *
+ * i2c-stub only emulates SMBus register access, the driver sends raw
+ * i2c_master_send() streams, hence an adapter of our own.
+ */
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/i2c.h>
+#include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#define EMU_MAX_SEG             128
+#define EMU_MAX_PAGE            8
+
+static unsigned short addr = 0x3c;
+module_param(addr, ushort, 0444);
+MODULE_PARM_DESC(addr, "7-bit address of the emulated panel (default 0x3c)");
+
+static const unsigned int emu_bus_khz[] = { 100, 400, 1000 };
+
+typedef struct ssd1306_emu {
+    struct i2c_adapter adap;
+    struct i2c_client *client;
+    struct dentry *dir;
+    /* Protects everything below, held by the transfer and the debugfs readers */
+    struct mutex lock;
+
+    /* Emulated controller */
+    uint8_t gddram[EMU_MAX_PAGE][EMU_MAX_SEG];
+    uint8_t col, col_start, col_end;
+    uint8_t page, page_start, page_end;
+    uint8_t addr_mode;              /* 0 horizontal, 1 vertical, 2 page */
+    uint8_t start_line;
+    bool display_on;
+    /* Command being decoded, its arguments can come in later bytes */
+    uint8_t cmd;
+    uint8_t args[6];
+    uint8_t nr_args, want_args;
+
+    /* Counters since the last reset */
+    u64 xfers;                      /* START ... STOP (one i2c_msg) */
+    u64 bytes;                      /* On the wire, address byte included */
+    u64 cmd_bytes;
+    u64 data_bytes;
+    u64 bits;                       /* START, 9 clocks per byte, STOP */
+} ssd1306_emu_t;
+
+static ssd1306_emu_t *emu;
+
+/* Arguments that follow each command byte, 0 for single byte commands */
+static int emu_cmd_args(uint8_t cmd)
+{
+    switch (cmd) {
+    case 0x20: case 0x81: case 0x8D: case 0xA8: case 0xD3:
+    case 0xD5: case 0xD9: case 0xDA: case 0xDB:
+        return 1;
+    case 0x21: case 0x22: case 0xA3:
+        return 2;
+    case 0x29: case 0x2A:
+        return 5;
+    case 0x26: case 0x27:
+        return 6;
+    default:
+        return 0;
+    }
+}
+
+static void emu_run_cmd(ssd1306_emu_t *emu)
+{
+    uint8_t cmd = emu->cmd;
+
+    switch (cmd) {
+    case 0x20:
+        emu->addr_mode = emu->args[0] & 0x3;
+        break;
+    case 0x21:
+        emu->col_start = emu->args[0] & 0x7f;
+        emu->col_end = emu->args[1] & 0x7f;
+        emu->col = emu->col_start;
+        break;
+    case 0x22:
+        emu->page_start = emu->args[0] & 0x7;
+        emu->page_end = emu->args[1] & 0x7;
+        emu->page = emu->page_start;
+        break;
+    case 0xAE:
+    case 0xAF:
+        emu->display_on = cmd & 1;
+        break;
+    default:
+        if (cmd >= 0x40 && cmd <= 0x7f)
+            emu->start_line = cmd & 0x3f;
+        else if (cmd >= 0xB0 && cmd <= 0xB7)
+            emu->page = cmd & 0x7;
+        else if (cmd <= 0x0f)
+            emu->col = (emu->col & 0xf0) | cmd;
+        else if (cmd >= 0x10 && cmd <= 0x17)
+            emu->col = (emu->col & 0x0f) | ((cmd & 0x7) << 4);
+        break;
+    }
+}
+
+static void emu_cmd_byte(ssd1306_emu_t *emu, uint8_t b)
+{
+    if (emu->nr_args < emu->want_args) {
+        emu->args[emu->nr_args++] = b;
+    } else {
+        emu->cmd = b;
+        emu->nr_args = 0;
+        emu->want_args = emu_cmd_args(b);
+    }
+
+    if (emu->nr_args == emu->want_args)
+        emu_run_cmd(emu);
+}
+
+/* GDDRAM pointer moves like the controller's, wrapping inside the window */
+static void emu_data_byte(ssd1306_emu_t *emu, uint8_t b)
+{
+    emu->gddram[emu->page][emu->col] = b;
+
+    switch (emu->addr_mode) {
+    case 0:
+        if (emu->col++ >= emu->col_end) {
+            emu->col = emu->col_start;
+            emu->page = emu->page >= emu->page_end ? emu->page_start : emu->page + 1;
+        }
+        break;
+    case 1:
+        if (emu->page++ >= emu->page_end) {
+            emu->page = emu->page_start;
+            emu->col = emu->col >= emu->col_end ? emu->col_start : emu->col + 1;
+        }
+        break;
+    default:
+        emu->col = (emu->col + 1) & (EMU_MAX_SEG - 1);
+        break;
+    }
+}
+
+/*
+ * Control byte: D/C# (0x40) selects data or commands, Co (0x80) means only
+ * one byte follows before the next control byte.
+ */
+static void emu_write(ssd1306_emu_t *emu, const uint8_t *buf, int len)
+{
+    bool data, cont;
+    int i = 0;
+
+    while (i < len) {
+        data = buf[i] & 0x40;
+        cont = buf[i] & 0x80;
+        i++;
+
+        for (; i < len; i++) {
+            if (data) {
+                emu_data_byte(emu, buf[i]);
+                emu->data_bytes++;
+            } else {
+                emu_cmd_byte(emu, buf[i]);
+                emu->cmd_bytes++;
+            }
+            if (cont) {
+                i++;
+                break;
+            }
+        }
+    }
+}
+
+static int emu_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+    ssd1306_emu_t *emu = i2c_get_adapdata(adap);
+    int i;
+
+    mutex_lock(&emu->lock);
+    for (i = 0; i < num; i++) {
+        if (msgs[i].addr != addr) {
+            mutex_unlock(&emu->lock);
+            return -ENXIO;
+        }
+
+        emu->xfers++;
+        emu->bytes += 1 + msgs[i].len;
+        emu->bits += 2 + 9 * (1 + msgs[i].len);
+
+        if (msgs[i].flags & I2C_M_RD)
+            // Status byte: D6 = display off
+            memset(msgs[i].buf, emu->display_on ? 0x00 : 0x40, msgs[i].len);
+        else
+            emu_write(emu, msgs[i].buf, msgs[i].len);
+    }
+    mutex_unlock(&emu->lock);
+
+    return num;
+}
+
+static u32 emu_func(struct i2c_adapter *adap)
+{
+    return I2C_FUNC_I2C;
+}
+
+static const struct i2c_algorithm emu_algo = {
+    .master_xfer = emu_xfer,
+    .functionality = emu_func,
+};
+
+static int emu_stats_show(struct seq_file *m, void *v)
+{
+    ssd1306_emu_t *emu = m->private;
+    int i;
+
+    mutex_lock(&emu->lock);
+    seq_printf(m, "xfers %llu\n", emu->xfers);
+    seq_printf(m, "bytes %llu\n", emu->bytes);
+    seq_printf(m, "cmd_bytes %llu\n", emu->cmd_bytes);
+    seq_printf(m, "data_bytes %llu\n", emu->data_bytes);
+    for (i = 0; i < ARRAY_SIZE(emu_bus_khz); i++)
+        seq_printf(m, "bus_us_%ukhz %llu\n", emu_bus_khz[i],
+                   div_u64(emu->bits * 1000, emu_bus_khz[i]));
+    mutex_unlock(&emu->lock);
+
+    return 0;
+}
+
+static int emu_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, emu_stats_show, inode->i_private);
+}
+
+static ssize_t emu_stats_reset(struct file *file, const char __user *buf, size_t len, loff_t *off)
+{
+    ssd1306_emu_t *emu = ((struct seq_file *)file->private_data)->private;
+
+    mutex_lock(&emu->lock);
+    emu->xfers = 0;
+    emu->bytes = 0;
+    emu->cmd_bytes = 0;
+    emu->data_bytes = 0;
+    emu->bits = 0;
+    mutex_unlock(&emu->lock);
+
+    return len;
+}
+
+static const struct file_operations emu_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = emu_stats_open,
+    .read = seq_read,
+    .write = emu_stats_reset,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static int emu_frame_show(struct seq_file *m, void *v)
+{
+    ssd1306_emu_t *emu = m->private;
+    int y, x, row;
+
+    mutex_lock(&emu->lock);
+    for (y = 0; y < EMU_MAX_PAGE * 8; y++) {
+        row = (y + emu->start_line) & (EMU_MAX_PAGE * 8 - 1);
+        for (x = 0; x < EMU_MAX_SEG; x++)
+            seq_putc(m, emu->gddram[row / 8][x] & (1 << (row % 8)) ? '#' : '.');
+        seq_putc(m, '\n');
+    }
+    mutex_unlock(&emu->lock);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(emu_frame);
+
+static int __init ssd1306_emu_init(void)
+{
+    struct i2c_board_info info = {
+        I2C_BOARD_INFO("ssd1306", 0),
+    };
+    int ret;
+
+    emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+    if (!emu)
+        return -ENOMEM;
+
+    mutex_init(&emu->lock);
+    emu->col_end = EMU_MAX_SEG - 1;
+    emu->page_end = EMU_MAX_PAGE - 1;
+    emu->addr_mode = 2;         // Page addressing sau reset
+
+    emu->adap.owner = THIS_MODULE;
+    emu->adap.algo = &emu_algo;
+    emu->adap.nr = -1;
+    strscpy(emu->adap.name, "ssd1306-emu", sizeof(emu->adap.name));
+    i2c_set_adapdata(&emu->adap, emu);
+
+    ret = i2c_add_adapter(&emu->adap);
+    if (ret) {
+        pr_err("[%s - %d] cannot add adapter %d\n", __func__, __LINE__, ret);
+        kfree(emu);
+        return ret;
+    }
+
+    emu->dir = debugfs_create_dir("ssd1306-emu", NULL);
+    debugfs_create_file("stats", 0600, emu->dir, emu, &emu_stats_fops);
+    debugfs_create_file("frame", 0400, emu->dir, emu, &emu_frame_fops);
+
+    // Panel ảo, ssd1306-i2c.ko probe lên nó như một thiết bị thật
+    info.addr = addr;
+    emu->client = i2c_new_client_device(&emu->adap, &info);
+    if (IS_ERR(emu->client))
+        pr_warn("[%s - %d] cannot add client at 0x%02x\n", __func__, __LINE__, addr);
+
+    pr_info("[%s - %d] i2c-%d\n", __func__, __LINE__, emu->adap.nr);
+    return 0;
+}
+
+static void __exit ssd1306_emu_exit(void)
+{
+    if (!IS_ERR(emu->client))
+        i2c_unregister_device(emu->client);
+    debugfs_remove_recursive(emu->dir);
+    i2c_del_adapter(&emu->adap);
+    kfree(emu);
+}
+
+module_init(ssd1306_emu_init);
+module_exit(ssd1306_emu_exit);
+
+MODULE_AUTHOR("dungla anhdungxd21@mail.com");
+MODULE_LICENSE("GPL");
\ No newline at end of file
@@ -7,31 +7,123 @@
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/fb.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
 #include <asm/uaccess.h>
 
+#include "ssd1306_ioctl.h"
+#include "ssd1306_bitmap.h"
+
 #define SSD1306_MAX_SEG         128
 #define SSD1306_MAX_LINE        7
+#define SSD1306_MAX_PAGE        (SSD1306_MAX_LINE + 1)
 #define SSD1306_DEF_FONT_SIZE   5
 #define MAX_BUFF                256
+/* Panels handled at the same time, one minor of /dev/ssd1306-N each */
+#define SSD1306_MAX_DEVICES     8
+
+/* Control byte in front of every I2C write: Co = 0, D/C# selects the stream type */
+#define SSD1306_CTRL_CMD        0x00
+#define SSD1306_CTRL_DATA       0x40
+/* Largest payload of one transaction, a full frame */
+#define SSD1306_MAX_XFER        (SSD1306_MAX_SEG * SSD1306_MAX_PAGE)
+
+#define SSD1306_WIDTH           SSD1306_MAX_SEG
+#define SSD1306_HEIGHT          (SSD1306_MAX_PAGE * 8)
+/* fbdev line: 1 bit per pixel, leftmost pixel in the MSB */
+#define SSD1306_FB_LINE         (SSD1306_WIDTH / 8)
+
+static bool fbdev = true;
+module_param(fbdev, bool, 0444);
+MODULE_PARM_DESC(fbdev, "Register a /dev/fbN framebuffer for the panel (default on)");
+
+static unsigned int fb_delay_ms = 50;
+module_param(fb_delay_ms, uint, 0444);
+MODULE_PARM_DESC(fb_delay_ms, "Delay between the first write to the mmap'd framebuffer and the flush to the panel");
+
+static bool splash = true;
+module_param(splash, bool, 0444);
+MODULE_PARM_DESC(splash, "Show \"Hello World\" once the panel is initialized (default on)");
+
+static bool terminal;
+module_param(terminal, bool, 0644);
+MODULE_PARM_DESC(terminal, "write() appends to a scrolling console instead of redrawing the screen");
+
+static unsigned int max_fps;
+module_param(max_fps, uint, 0644);
+MODULE_PARM_DESC(max_fps, "Default frame rate limit of new panels, 0 = flush as fast as the bus allows");
+
+/* Bytes of a terminal write() copied from user space per lock hold */
+#define SSD1306_TERM_CHUNK      64
 
 typedef struct ssd1306_i2c_module {
     struct i2c_client *client;
+    /* Protects frame, frame_seq and dying, never held across I2C traffic */
+    struct mutex lock;
+    /* Serializes flushes: the bus, snap and shown belong to its holder */
+    struct mutex flush_lock;
+    struct delayed_work flush_work;
+    wait_queue_head_t flush_wq;
+    u64 frame_seq;              /* Bumped on every frame update */
+    u64 flushed_seq;            /* frame_seq of the last frame on the panel */
+    int flush_err;              /* First I2C error since the last fsync() */
+    bool dying;                 /* Set by remove, updates no longer schedule a flush */
+    /* One reference for the bound client, one per open file, the last put frees the module */
+    struct kref ref;
+    /* Pacing: no flush starts before next_flush (jiffies), 0 fps = no limit */
+    unsigned int max_fps;
+    unsigned long next_flush;
+    /* Statistics, written by the flush: updates that never reached the panel, achieved rate */
+    u64 dropped;
+    u64 fps_t0;                 /* Start of the current 1 s window (ns) */
+    unsigned int fps_frames;
+    unsigned int fps_x10;       /* Rate of the last full window, in 0.1 fps */
     uint8_t current_line;
     uint8_t cursor_pos;
     uint8_t font_size;
+    /* Page of frame shown on the top row (display start line / 8), moved by terminal scrolling */
+    uint8_t start_page;
+    /* Start page the panel uses now, owned by the flush like shown */
+    uint8_t shown_start;
+    /* Terminal: a '\n' was written, the next character starts a new line */
+    bool term_newline;
+    /* Shadow framebuffer: text is drawn here, ssd1306_flush() sends the difference */
+    uint8_t frame[SSD1306_MAX_PAGE][SSD1306_MAX_SEG];
+    /* Copy of frame taken by the flush, so writers do not wait for the bus */
+    uint8_t snap[SSD1306_MAX_PAGE][SSD1306_MAX_SEG];
+    /* What the panel shows now, only valid when full_redraw is false */
+    uint8_t shown[SSD1306_MAX_PAGE][SSD1306_MAX_SEG];
+    bool full_redraw;
+    /* Control byte + payload of the bulk transfer being built */
+    uint8_t xfer_buf[1 + SSD1306_MAX_XFER];
+    struct fb_info *info;
+    struct fb_deferred_io defio;
+    /* Last text written through the non-terminal write(), what read() returns */
+    char message[MAX_BUFF];
     dev_t dev_num;
-    struct class *class;
     struct device *device;
-    struct cdev cdev;
+    /* Allocated on its own: its kobject may outlive the module until the last fput() */
+    struct cdev *cdev;
 } ssd1306_i2c_module_t;
 
-char message[MAX_BUFF];
-ssd1306_i2c_module_t* module_ssd1306 = NULL;
+/* Shared by all panels, each probe takes one minor of the region */
+static dev_t ssd1306_devt;
+static struct class *ssd1306_class;
+/* Minor -> panel, open() takes its reference under the lock so it never gets a removed panel */
+static DEFINE_IDR(ssd1306_minors);
+static DEFINE_MUTEX(ssd1306_minors_lock);
 
 static int ssd1306_open(struct inode *inodep, struct file *filep);
 static int ssd1306_release(struct inode *inodep, struct file *filep);
 static ssize_t ssd1306_write_ops(struct file *filep, const char *buf, size_t len, loff_t *offset);
 static ssize_t ssd1306_read(struct file *filep, char __user *buf, size_t len, loff_t *offset);
+static int ssd1306_fsync(struct file *filep, loff_t start, loff_t end, int datasync);
+static long ssd1306_ioctl(struct file *filep, unsigned int cmd, unsigned long arg);
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
@@ -39,11 +131,23 @@ static struct file_operations fops = {
     .release = ssd1306_release,
     .read = ssd1306_read,
     .write = ssd1306_write_ops,
+    .fsync = ssd1306_fsync,
+    .unlocked_ioctl = ssd1306_ioctl,
+    // struct ssd1306_image có cùng layout trên 32 và 64 bit, chỉ cần đổi con trỏ arg
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
 static void ssd1306_print_string(ssd1306_i2c_module_t *module, unsigned char *str);
 static void ssd1306_print_char(ssd1306_i2c_module_t *module, unsigned char c);
+static void ssd1306_term_putc(ssd1306_i2c_module_t *module, unsigned char c);
+static ssize_t ssd1306_term_write(ssd1306_i2c_module_t *module, const char __user *buf, size_t len);
 static void ssd1306_clear(ssd1306_i2c_module_t *module);
+static void ssd1306_set_cursor(ssd1306_i2c_module_t *module, uint8_t current_line, uint8_t cursor_pos);
+static int ssd1306_flush(ssd1306_i2c_module_t *module);
+static void ssd1306_account_frame(ssd1306_i2c_module_t *module, u64 seq);
+static void ssd1306_frame_updated(ssd1306_i2c_module_t *module);
+static int ssd1306_wait_flush(ssd1306_i2c_module_t *module);
+static int ssd1306_draw_image(ssd1306_i2c_module_t *module, struct ssd1306_image __user *uimg);
 
 // font
 static const char ssd1306_font[96][SSD1306_DEF_FONT_SIZE] = {
@@ -163,68 +267,155 @@ static int ssd1306_i2c_read(ssd1306_i2c_module_t *module, unsigned char *out_buf
     return ret;
 }
 
-static void ssd1306_write(ssd1306_i2c_module_t *module, bool is_cmd, unsigned char data)
+/*
+ * One control byte, then a whole command or data stream in the same
+ * transaction: one START/address/STOP for up to a full frame instead of one
+ * per byte. Split only if the adapter cannot take that much at once.
+ */
+static int ssd1306_write_bulk(ssd1306_i2c_module_t *module, bool is_cmd, const uint8_t *data,
+                              unsigned int len)
 {
-    unsigned char buf[2] = {0};
+    const struct i2c_adapter_quirks *quirks = module->client->adapter->quirks;
+    unsigned int max = SSD1306_MAX_XFER;
+    unsigned int chunk;
+    int ret;
+
+    if (quirks && quirks->max_write_len && quirks->max_write_len - 1 < max)
+        max = quirks->max_write_len - 1;
+
+    while (len) {
+        chunk = min(len, max);
+        module->xfer_buf[0] = is_cmd ? SSD1306_CTRL_CMD : SSD1306_CTRL_DATA;
+        memcpy(&module->xfer_buf[1], data, chunk);
 
-    if(is_cmd) {
-        buf[0] = 0x00;
-    } else {
-        buf[0] = 0x40;
+        ret = ssd1306_i2c_write(module, module->xfer_buf, chunk + 1);
+        if (ret < 0)
+            return ret;
+
+        data += chunk;
+        len -= chunk;
     }
 
-    buf[1] = data;
-    ssd1306_i2c_write(module, buf, 2);
+    return 0;
+}
+
+static int ssd1306_write(ssd1306_i2c_module_t *module, bool is_cmd, unsigned char data)
+{
+    return ssd1306_write_bulk(module, is_cmd, &data, 1);
+}
+
+static void ssd1306_module_free(struct kref *ref)
+{
+    ssd1306_i2c_module_t *module = container_of(ref, ssd1306_i2c_module_t, ref);
+
+    kfree(module);
 }
 
 static int ssd1306_open(struct inode *inodep, struct file *filep)
 {
+    ssd1306_i2c_module_t *module;
+
     pr_info("[%s - %d]\n", __func__, __LINE__);
+
+    // Panel có thể vừa bị remove sau khi chrdev_open() lấy được cdev
+    mutex_lock(&ssd1306_minors_lock);
+    module = idr_find(&ssd1306_minors, iminor(inodep));
+    if (module)
+        kref_get(&module->ref);
+    mutex_unlock(&ssd1306_minors_lock);
+    if (!module)
+        return -ENODEV;
+
+    filep->private_data = module;
     return 0;
 }
 
 static int ssd1306_release(struct inode *inodep, struct file *filep)
 {
+    ssd1306_i2c_module_t *module = filep->private_data;
+
     pr_info("[%s - %d]\n", __func__, __LINE__);
     filep->private_data = NULL;
+    // File cuối cùng đóng sau khi remove thì giải phóng module ở đây
+    kref_put(&module->ref, ssd1306_module_free);
     return 0;
 }
 
 static ssize_t ssd1306_write_ops(struct file *filep, const char *buf, size_t len, loff_t *offset)
 {
+    ssd1306_i2c_module_t *module = filep->private_data;
     int ret;
     pr_info("[%s - %d]\n", __func__, __LINE__);
 
-    memset(message, 0x0, sizeof(message));
-    if (len > sizeof(message) -1) {
+    if (READ_ONCE(terminal))
+        return ssd1306_term_write(module, buf, len);
+
+    if (len > sizeof(module->message) -1) {
         pr_info("[%s - %d] data input to large, truncating...\n", __func__, __LINE__);
-        len = sizeof(message) - 1;
+        len = sizeof(module->message) - 1;
     }
 
-    ret = copy_from_user(message, buf, len);
+    // message thuộc về từng panel, lock để write() đồng thời không ghi đè lẫn nhau
+    mutex_lock(&module->lock);
+    memset(module->message, 0x0, sizeof(module->message));
+    ret = copy_from_user(module->message, buf, len);
     if (ret) {
+        mutex_unlock(&module->lock);
         pr_info("[%s - %d] copy_from_user failed\n", __func__, __LINE__);
         return -ENOMSG;
     }
 
-    pr_info("[%s - %d] data from user: %s\n", __func__, __LINE__, message);
-    ssd1306_clear(module_ssd1306);
-    ssd1306_print_string(module_ssd1306, message);
+    pr_info("[%s - %d] data from user: %s\n", __func__, __LINE__, module->message);
+    // Chỉ vẽ vào frame rồi trả về ngay, flush_work đẩy frame mới nhất xuống panel
+    ssd1306_print_string(module, module->message);
+    ssd1306_frame_updated(module);
+    mutex_unlock(&module->lock);
 
     return len;
 }
 
+static int ssd1306_fsync(struct file *filep, loff_t start, loff_t end, int datasync)
+{
+    return ssd1306_wait_flush(filep->private_data);
+}
+
+static long ssd1306_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    ssd1306_i2c_module_t *module = filep->private_data;
+
+    switch (cmd) {
+    case SSD1306_IOC_WAIT_FLUSH:
+        return ssd1306_wait_flush(module);
+    case SSD1306_IOC_DRAW_IMAGE:
+        return ssd1306_draw_image(module, (struct ssd1306_image __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
 static ssize_t ssd1306_read(struct file *file, char __user *buff, size_t len, loff_t *off)
 {
-    ssize_t bytes_to_read = min(len, (size_t)(MAX_BUFF - *off));
+    ssd1306_i2c_module_t *module = file->private_data;
+    ssize_t bytes_to_read;
+    int ret;
     pr_info("[%s - %d]\n", __func__, __LINE__);
 
+    // pread() có thể đưa offset vượt MAX_BUFF, trừ trước sẽ bị tràn size_t
+    if(*off < 0 || *off >= MAX_BUFF) {
+        pr_info("[%s - %d] end of file\n", __func__, __LINE__);
+        return 0;
+    }
+
+    bytes_to_read = min(len, (size_t)(MAX_BUFF - *off));
     if(bytes_to_read <= 0) {
         pr_info("[%s - %d] end of file\n", __func__, __LINE__);
         return 0;
     }
 
-    if(copy_from_user(buff, message + *off, bytes_to_read)){
+    mutex_lock(&module->lock);
+    ret = copy_to_user(buff, module->message + *off, bytes_to_read);
+    mutex_unlock(&module->lock);
+    if(ret){
         pr_err("[%s - %d] read data failed\n", __func__, __LINE__);
         return -EFAULT;
     }
@@ -235,70 +426,356 @@ static ssize_t ssd1306_read(struct file *file, char __user *buff, size_t len, lo
     return bytes_to_read;
 }
 
+/*
+ * /sys/class/ssd1306_class/ssd1306-N/:
+ *   max_fps         frame rate limit of this panel, 0 = none
+ *   fps             achieved rate over the last second, 0 when idle
+ *   dropped_frames  updates replaced by a newer one before being flushed
+ */
+static ssize_t max_fps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    ssd1306_i2c_module_t *module = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(module->max_fps));
+}
+
+static ssize_t max_fps_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    ssd1306_i2c_module_t *module = dev_get_drvdata(dev);
+    unsigned int fps;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &fps);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(module->max_fps, fps);
+    return count;
+}
+static DEVICE_ATTR_RW(max_fps);
+
+static ssize_t fps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    ssd1306_i2c_module_t *module = dev_get_drvdata(dev);
+    unsigned int fps = READ_ONCE(module->fps_x10);
+
+    // Không có frame nào trong 2 giây: panel đang rảnh
+    if (ktime_get_ns() - READ_ONCE(module->fps_t0) > 2 * NSEC_PER_SEC)
+        fps = 0;
+
+    return sysfs_emit(buf, "%u.%u\n", fps / 10, fps % 10);
+}
+static DEVICE_ATTR_RO(fps);
+
+static ssize_t dropped_frames_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    ssd1306_i2c_module_t *module = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%llu\n", READ_ONCE(module->dropped));
+}
+static DEVICE_ATTR_RO(dropped_frames);
+
+static struct attribute *ssd1306_attrs[] = {
+    &dev_attr_max_fps.attr,
+    &dev_attr_fps.attr,
+    &dev_attr_dropped_frames.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(ssd1306);
+
 static int ssd1306_create_device_file(ssd1306_i2c_module_t *module)
 {
+    int minor;
     int ret = 0;
     pr_info("[%s - %d]\n", __func__, __LINE__);
 
-    ret = alloc_chrdev_region(&(module->dev_num), 0, 1, "ssd1306_devnum");
-    if (ret < 0) {
-        pr_err("[%s - %d] cannot register major number\n", __func__, __LINE__);
-        goto alloc_dev_failed;
+    mutex_lock(&ssd1306_minors_lock);
+    minor = idr_alloc(&ssd1306_minors, module, 0, SSD1306_MAX_DEVICES, GFP_KERNEL);
+    mutex_unlock(&ssd1306_minors_lock);
+    if (minor < 0) {
+        pr_err("[%s - %d] no free minor number\n", __func__, __LINE__);
+        return minor;
     }
+    module->dev_num = MKDEV(MAJOR(ssd1306_devt), minor);
 
     pr_info("[%s - %d] major = %d, minor = %d\n", __func__, __LINE__, MAJOR(module->dev_num), MINOR(module->dev_num));
-    
-    // Class
-    module->class = class_create("ssd1306_class");
-    if (module->class == NULL) {
-        pr_err("[%s - %d] cannot register class device\n", __func__, __LINE__);
-        goto create_class_failed;
-    }
 
-    // Device
-    module->device = device_create(module->class, NULL, module->dev_num, NULL, "ssd1306"); // /dev/ssd1306
-    if(module->device == NULL) {
-        pr_err("[%s - %d] cannot create device\n", __func__, __LINE__);
-        goto create_device_failed;
+    module->cdev = cdev_alloc();
+    if(!module->cdev) {
+        ret = -ENOMEM;
+        goto cdev_alloc_fail;
     }
+    module->cdev->ops = &fops;
+    module->cdev->owner = THIS_MODULE;
 
-    cdev_init(&module->cdev, &fops);
-    (module->cdev).owner = THIS_MODULE;
-    (module->cdev).dev = module->dev_num;
-
-    ret = cdev_add(&module->cdev, module->dev_num, 1);
+    ret = cdev_add(module->cdev, module->dev_num, 1);
     if(ret) {
         pr_err("Error occur when add properties for struct cdev");
-        goto cdev_add_fail;
+        kobject_put(&module->cdev->kobj);
+        goto cdev_alloc_fail;
     }
 
-    pr_info("[%s - %d] read done\n", __func__, __LINE__);
-    return ret;
+    // Device: /dev/ssd1306-<minor>, nằm dưới i2c_client trong sysfs
+    module->device = device_create_with_groups(ssd1306_class, &module->client->dev,
+                                               module->dev_num, module, ssd1306_groups,
+                                               "ssd1306-%d", minor);
+    if(IS_ERR(module->device)) {
+        pr_err("[%s - %d] cannot create device\n", __func__, __LINE__);
+        ret = PTR_ERR(module->device);
+        goto create_device_failed;
+    }
+
+    return 0;
 
-cdev_add_fail:
-    device_destroy(module->class, module->dev_num);
 create_device_failed:
-    class_destroy(module->class);
-create_class_failed:
-    unregister_chrdev_region(module->dev_num, 1);
-alloc_dev_failed:
+    cdev_del(module->cdev);
+cdev_alloc_fail:
+    mutex_lock(&ssd1306_minors_lock);
+    idr_remove(&ssd1306_minors, minor);
+    mutex_unlock(&ssd1306_minors_lock);
     return ret;
+}
 
+static void ssd1306_destroy_device_file(ssd1306_i2c_module_t *module)
+{
+    device_destroy(ssd1306_class, module->dev_num);
+    cdev_del(module->cdev);
+    // Từ đây open() không tìm thấy panel nữa, file đang mở giữ reference riêng
+    mutex_lock(&ssd1306_minors_lock);
+    idr_remove(&ssd1306_minors, MINOR(module->dev_num));
+    mutex_unlock(&ssd1306_minors_lock);
 }
 
 static void ssd1306_set_brigtness(ssd1306_i2c_module_t *module, uint8_t brightness)
 {
-    ssd1306_write(module, true, 0x81);
-    ssd1306_write(module, true, brightness);
+    uint8_t cmds[] = { 0x81, brightness };
+
+    ssd1306_write_bulk(module, true, cmds, sizeof(cmds));
 }
 
+// Chỉ xóa shadow framebuffer, dữ liệu được gửi xuống panel khi gọi ssd1306_flush()
 static void ssd1306_clear(ssd1306_i2c_module_t *module)
 {
-    unsigned int total = 128 * 8;
-    int i = 0;
-    for(i = 0; i < total; i++) {
-        ssd1306_write(module, false, 0);
+    memset(module->frame, 0, sizeof(module->frame));
+    module->start_page = 0;
+    module->term_newline = false;
+}
+
+/* Limit the GDDRAM write window, data bytes then fill it column by column */
+static int ssd1306_set_window(ssd1306_i2c_module_t *module, uint8_t col_start, uint8_t col_end,
+                               uint8_t page_start, uint8_t page_end)
+{
+    uint8_t cmds[] = {
+        0x21,           // cmd for the column start and end addrets
+        col_start,      // column start addr
+        col_end,        // column end addr
+        0x22,           // cmd for the page start and end addrets
+        page_start,     // page start addr
+        page_end,       // page end addr
+    };
+
+    return ssd1306_write_bulk(module, true, cmds, sizeof(cmds));
+}
+
+/*
+ * Send what differs between frame and shown. Each page gets one window
+ * from its first to its last changed column, so updating one line of text
+ * costs that line only.
+ */
+static int ssd1306_flush(ssd1306_i2c_module_t *module)
+{
+    int page, first, last;
+    int ret = 0;
+    uint8_t start;
+    u64 seq;
+
+    mutex_lock(&module->flush_lock);
+
+    /* Whatever was drawn up to here goes out, later updates wait for the next flush */
+    mutex_lock(&module->lock);
+    memcpy(module->snap, module->frame, sizeof(module->frame));
+    start = module->start_page;
+    seq = module->frame_seq;
+    mutex_unlock(&module->lock);
+
+    ssd1306_account_frame(module, seq);
+
+    /* Horizontal addressing wraps to the next page, a full frame is one burst */
+    if (module->full_redraw) {
+        ret = ssd1306_set_window(module, 0, SSD1306_MAX_SEG - 1, 0, SSD1306_MAX_LINE);
+        if (!ret)
+            ret = ssd1306_write_bulk(module, false, &module->snap[0][0], sizeof(module->snap));
+        if (!ret) {
+            memcpy(module->shown, module->snap, sizeof(module->snap));
+            module->full_redraw = false;
+            /* Không biết start line hiện tại của panel, luôn gửi lại */
+            module->shown_start = start ^ 1;
+        }
+        goto scroll;
+    }
+
+    for (page = 0; page < SSD1306_MAX_PAGE; page++) {
+        for (first = 0; first < SSD1306_MAX_SEG; first++)
+            if (module->snap[page][first] != module->shown[page][first])
+                break;
+        if (first == SSD1306_MAX_SEG)
+            continue;
+
+        for (last = SSD1306_MAX_SEG - 1; last > first; last--)
+            if (module->snap[page][last] != module->shown[page][last])
+                break;
+
+        ret = ssd1306_set_window(module, first, last, page, page);
+        // Window sai thì data ghi vào chỗ khác, xử lý như lỗi data
+        if (!ret)
+            ret = ssd1306_write_bulk(module, false, &module->snap[page][first], last - first + 1);
+        // Lỗi bus: không biết panel đang hiện gì, lần sau gửi lại cả frame
+        if (ret) {
+            module->full_redraw = true;
+            break;
+        }
+        memcpy(&module->shown[page][first], &module->snap[page][first], last - first + 1);
+    }
+
+scroll:
+    /*
+     * Terminal scrolling only moves the display start line: the page that
+     * scrolled in was rewritten above, the other pages stay in GDDRAM. Move
+     * it after the data so the old top line never shows at the bottom.
+     */
+    if (!ret && start != module->shown_start) {
+        ret = ssd1306_write(module, true, 0x40 | (start * 8));
+        if (!ret)
+            module->shown_start = start;
+    }
+
+    if (ret && !module->flush_err)
+        module->flush_err = ret;
+    WRITE_ONCE(module->flushed_seq, seq);
+    mutex_unlock(&module->flush_lock);
+
+    wake_up_all(&module->flush_wq);
+    return ret;
+}
+
+/*
+ * Called by the flush with flush_lock held, seq is the frame it is about to
+ * send. Frames between the last one shown and seq were replaced before they
+ * reached the panel. Also arms the pacing deadline for the next flush.
+ */
+static void ssd1306_account_frame(ssd1306_i2c_module_t *module, u64 seq)
+{
+    unsigned int fps = READ_ONCE(module->max_fps);
+    u64 now = ktime_get_ns();
+
+    WRITE_ONCE(module->next_flush, jiffies + (fps ? DIV_ROUND_UP(HZ, fps) : 0));
+
+    if (seq <= module->flushed_seq)
+        return;
+
+    WRITE_ONCE(module->dropped, module->dropped + seq - module->flushed_seq - 1);
+    module->fps_frames++;
+    if (now - module->fps_t0 >= NSEC_PER_SEC) {
+        WRITE_ONCE(module->fps_x10, div64_u64((u64)module->fps_frames * 10 * NSEC_PER_SEC,
+                                              now - module->fps_t0));
+        WRITE_ONCE(module->fps_t0, now);
+        module->fps_frames = 0;
+    }
+}
+
+/*
+ * Writers that arrive while a flush is pending or running only re-queue the
+ * work, which is already pending or will be: all of them are coalesced into
+ * one more flush of the newest frame. With max_fps set that flush waits for
+ * the pacing deadline, so under overload the panel gets the latest frame at
+ * the configured rate and everything in between is dropped.
+ */
+static void ssd1306_flush_work(struct work_struct *work)
+{
+    ssd1306_i2c_module_t *module = container_of(to_delayed_work(work), ssd1306_i2c_module_t,
+                                                flush_work);
+
+    ssd1306_flush(module);
+}
+
+/* Called with module->lock held after drawing into frame */
+static void ssd1306_frame_updated(ssd1306_i2c_module_t *module)
+{
+    unsigned long next = READ_ONCE(module->next_flush);
+
+    module->frame_seq++;
+    if (module->dying)
+        return;
+    schedule_delayed_work(&module->flush_work,
+                          time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+/* Wait until the frame as of now is on the panel, report a failed flush once */
+static int ssd1306_wait_flush(ssd1306_i2c_module_t *module)
+{
+    u64 target;
+    int ret;
+
+    mutex_lock(&module->lock);
+    target = module->frame_seq;
+    mutex_unlock(&module->lock);
+
+    if (wait_event_interruptible(module->flush_wq, READ_ONCE(module->flushed_seq) >= target ||
+                                 READ_ONCE(module->dying)))
+        return -ERESTARTSYS;
+    // Panel đã bị remove, frame mới không còn được flush nữa
+    if (READ_ONCE(module->dying))
+        return -ENODEV;
+
+    mutex_lock(&module->flush_lock);
+    ret = module->flush_err;
+    module->flush_err = 0;
+    mutex_unlock(&module->flush_lock);
+
+    return ret;
+}
+
+/* The conversion runs on a private copy, the frame lock is held for a memcpy-sized step */
+static int ssd1306_draw_image(ssd1306_i2c_module_t *module, struct ssd1306_image __user *uimg)
+{
+    struct ssd1306_image img;
+    uint8_t (*pages)[SSD1306_MAX_SEG];
+    uint8_t *data;
+    int ret = 0;
+
+    if (copy_from_user(&img, uimg, sizeof(img)))
+        return -EFAULT;
+    if (img.reserved)
+        return -EINVAL;
+
+    data = memdup_user(u64_to_user_ptr(img.data), SSD1306_IMG_BYTES);
+    if (IS_ERR(data))
+        return PTR_ERR(data);
+
+    pages = kmalloc(sizeof(module->frame), GFP_KERNEL);
+    if (!pages) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (ssd1306_img_to_pages(pages, data, img.rotate)) {
+        ret = -EINVAL;
+        goto out;
     }
+
+    mutex_lock(&module->lock);
+    memcpy(module->frame, pages, sizeof(module->frame));
+    module->start_page = 0;
+    module->term_newline = false;
+    ssd1306_set_cursor(module, 0, 0);
+    ssd1306_frame_updated(module);
+    mutex_unlock(&module->lock);
+
+out:
+    kfree(pages);
+    kfree(data);
+    return ret;
 }
 
 static void ssd1306_set_cursor(ssd1306_i2c_module_t *module, uint8_t current_line, uint8_t cursor_pos)
@@ -306,12 +783,6 @@ static void ssd1306_set_cursor(ssd1306_i2c_module_t *module, uint8_t current_lin
     if((current_line <= SSD1306_MAX_LINE) && (cursor_pos < SSD1306_MAX_SEG)) {
         module->current_line = current_line;            // Save the specified line number
         module->cursor_pos = cursor_pos;                // Save the specified cursor position
-        ssd1306_write(module, true, 0x21);              // cmd for the column start and end addrets
-        ssd1306_write(module, true, cursor_pos);        // column start addr
-        ssd1306_write(module, true, SSD1306_MAX_SEG -1);// column end addr
-        ssd1306_write(module, true, 0x22);              // cmd for the page start and end addrets
-        ssd1306_write(module, true, current_line);      // page start addr
-        ssd1306_write(module, true, SSD1306_MAX_LINE);  // page end addr
     }
 }
 
@@ -324,7 +795,7 @@ static void ssd1306_goto_next_line(ssd1306_i2c_module_t *module)
 
 static void ssd1306_print_char(ssd1306_i2c_module_t *module, unsigned char c)
 {
-    uint8_t data_byte;
+    uint8_t *col;
     uint8_t temp = 0;
 
     if(((module->cursor_pos + module->font_size) >= SSD1306_MAX_SEG) || (c == '\n')) {
@@ -332,15 +803,18 @@ static void ssd1306_print_char(ssd1306_i2c_module_t *module, unsigned char c)
     }
 
     if (c != '\n') {
+        // Ký tự ngoài bảng font được vẽ thành dấu cách
+        if (c < 0x20 || c > 0x7f)
+            c = ' ';
         c -= 0x20;
+        col = &module->frame[module->current_line][module->cursor_pos];
         do {
-            data_byte = ssd1306_font[c][temp];
-            ssd1306_write(module, false, data_byte);
+            *col++ = ssd1306_font[c][temp];
             module->cursor_pos++;
             temp++;
         } while (temp < module->font_size);
 
-        ssd1306_write(module, false, 0x00);
+        *col = 0x00;
         module->cursor_pos++;
     }
 }
@@ -354,69 +828,326 @@ static void ssd1306_print_string(ssd1306_i2c_module_t *module, unsigned char *st
     }
 }
 
+/*
+ * Terminal: current_line is the row on screen, the frame page behind it is
+ * (start_page + current_line). At the bottom a new line reuses the page of
+ * the top row and only the start line moves, so appending one line touches
+ * one page of GDDRAM.
+ */
+static void ssd1306_term_newline(ssd1306_i2c_module_t *module)
+{
+    if (module->current_line < SSD1306_MAX_LINE)
+        module->current_line++;
+    else
+        module->start_page = (module->start_page + 1) & SSD1306_MAX_LINE;
+
+    module->cursor_pos = 0;
+    memset(module->frame[(module->start_page + module->current_line) & SSD1306_MAX_LINE], 0,
+           SSD1306_MAX_SEG);
+}
+
+static void ssd1306_term_putc(ssd1306_i2c_module_t *module, unsigned char c)
+{
+    uint8_t *col;
+    int i;
+
+    switch (c) {
+    case '\n':
+        /*
+         * Xuống dòng khi có ký tự tiếp theo: "line\n" chỉ vẽ một page, và
+         * lần ghi sau cuộn màn hình cùng lúc vẽ dòng mới.
+         */
+        if (module->term_newline)
+            ssd1306_term_newline(module);
+        module->term_newline = true;
+        return;
+    case '\r':
+        module->cursor_pos = 0;
+        return;
+    }
+
+    if (module->term_newline) {
+        ssd1306_term_newline(module);
+        module->term_newline = false;
+    }
+    if (module->cursor_pos + module->font_size >= SSD1306_MAX_SEG)
+        ssd1306_term_newline(module);
+
+    if (c < 0x20 || c > 0x7f)
+        c = ' ';
+    c -= 0x20;
+    col = &module->frame[(module->start_page + module->current_line) & SSD1306_MAX_LINE]
+                        [module->cursor_pos];
+    for (i = 0; i < module->font_size; i++)
+        *col++ = ssd1306_font[c][i];
+    *col = 0x00;
+    module->cursor_pos += module->font_size + 1;
+}
+
+/*
+ * Any length: copied and drawn in chunks, the cursor stays where the last
+ * write ended. The whole write() is one frame update, so dropped_frames does
+ * not count the chunking.
+ */
+static ssize_t ssd1306_term_write(ssd1306_i2c_module_t *module, const char __user *buf, size_t len)
+{
+    char chunk[SSD1306_TERM_CHUNK];
+    size_t done = 0;
+    size_t n, i;
+
+    while (done < len) {
+        n = min(len - done, sizeof(chunk));
+        if (copy_from_user(chunk, buf + done, n)) {
+            if (!done)
+                return -EFAULT;
+            break;
+        }
+
+        mutex_lock(&module->lock);
+        for (i = 0; i < n; i++)
+            ssd1306_term_putc(module, chunk[i]);
+        mutex_unlock(&module->lock);
+
+        done += n;
+    }
+
+    if (done) {
+        mutex_lock(&module->lock);
+        ssd1306_frame_updated(module);
+        mutex_unlock(&module->lock);
+    }
+
+    return done;
+}
+
+/*
+ * fbdev: applications draw into a vmalloc'd 1bpp buffer, mmap'd or through
+ * write()/the fb_ops drawing helpers. Deferred I/O collects the touched
+ * pages and calls ssd1306_fb_deferred_io() after fb_delay_ms, which turns the
+ * buffer into the page-major shadow frame. ssd1306_flush() then sends only
+ * what changed, so a whole frame of damage costs one flush.
+ */
+static void ssd1306_fb_to_frame(ssd1306_i2c_module_t *module, const uint8_t *vmem)
+{
+    // vmem cùng layout với ảnh 128x64 không xoay
+    ssd1306_img_to_pages(module->frame, vmem, 0);
+    // fbdev vẽ cả màn hình với page 0 ở trên cùng
+    module->start_page = 0;
+}
+
+static void ssd1306_fb_deferred_io(struct fb_info *info, struct list_head *pagereflist)
+{
+    ssd1306_i2c_module_t *module = info->par;
+
+    // Flush qua flush_work như write(), để max_fps cũng áp dụng cho fbdev
+    mutex_lock(&module->lock);
+    ssd1306_fb_to_frame(module, info->screen_buffer);
+    ssd1306_frame_updated(module);
+    mutex_unlock(&module->lock);
+}
+
+/* write()/fillrect/imageblit do not fault on the mapping, kick the worker ourselves */
+static void ssd1306_fb_defio_damage_range(struct fb_info *info, off_t off, size_t len)
+{
+    schedule_delayed_work(&info->deferred_work, info->fbdefio->delay);
+}
+
+static void ssd1306_fb_defio_damage_area(struct fb_info *info, u32 x, u32 y, u32 width, u32 height)
+{
+    schedule_delayed_work(&info->deferred_work, info->fbdefio->delay);
+}
+
+FB_GEN_DEFAULT_DEFERRED_SYSMEM_OPS(ssd1306_fb,
+                                   ssd1306_fb_defio_damage_range,
+                                   ssd1306_fb_defio_damage_area)
+
+static const struct fb_ops ssd1306_fb_ops = {
+    .owner = THIS_MODULE,
+    FB_DEFAULT_DEFERRED_OPS(ssd1306_fb),
+};
+
+static int ssd1306_fb_init(ssd1306_i2c_module_t *module)
+{
+    struct fb_info *info;
+    void *vmem;
+    int ret;
+
+    info = framebuffer_alloc(0, &module->client->dev);
+    if (!info)
+        return -ENOMEM;
+
+    // Deferred I/O map từng page qua vmalloc_to_page() nên buffer phải là vmalloc
+    vmem = vzalloc(PAGE_ALIGN(SSD1306_FB_LINE * SSD1306_HEIGHT));
+    if (!vmem) {
+        ret = -ENOMEM;
+        goto free_info;
+    }
+
+    info->par = module;
+    info->fbops = &ssd1306_fb_ops;
+    info->screen_buffer = vmem;
+    info->flags = FBINFO_VIRTFB;
+
+    strscpy(info->fix.id, "ssd1306", sizeof(info->fix.id));
+    info->fix.type = FB_TYPE_PACKED_PIXELS;
+    info->fix.visual = FB_VISUAL_MONO10;
+    info->fix.line_length = SSD1306_FB_LINE;
+    info->fix.smem_len = SSD1306_FB_LINE * SSD1306_HEIGHT;
+    info->fix.accel = FB_ACCEL_NONE;
+
+    info->var.xres = SSD1306_WIDTH;
+    info->var.yres = SSD1306_HEIGHT;
+    info->var.xres_virtual = SSD1306_WIDTH;
+    info->var.yres_virtual = SSD1306_HEIGHT;
+    info->var.bits_per_pixel = 1;
+    info->var.red.length = 1;
+    info->var.green.length = 1;
+    info->var.blue.length = 1;
+
+    module->defio.delay = msecs_to_jiffies(fb_delay_ms);
+    module->defio.deferred_io = ssd1306_fb_deferred_io;
+    info->fbdefio = &module->defio;
+
+    ret = fb_deferred_io_init(info);
+    if (ret)
+        goto free_vmem;
+
+    ret = register_framebuffer(info);
+    if (ret)
+        goto cleanup_defio;
+
+    module->info = info;
+    pr_info("[%s - %d] fb%d: %dx%d framebuffer\n", __func__, __LINE__, info->node,
+            SSD1306_WIDTH, SSD1306_HEIGHT);
+    return 0;
+
+cleanup_defio:
+    fb_deferred_io_cleanup(info);
+free_vmem:
+    vfree(vmem);
+free_info:
+    framebuffer_release(info);
+    return ret;
+}
+
+static void ssd1306_fb_exit(ssd1306_i2c_module_t *module)
+{
+    struct fb_info *info = module->info;
+
+    if (!info)
+        return;
+
+    unregister_framebuffer(info);
+    fb_deferred_io_cleanup(info);
+    vfree(info->screen_buffer);
+    framebuffer_release(info);
+    module->info = NULL;
+}
+
 static int ssd1306_display_init(ssd1306_i2c_module_t *module)
 {
+    static const uint8_t init_cmds[] = {
+        0xAE,       // Entire Display OFF
+        0xD5,       // Set Display Clock Divide Ratio and Oscillator Frequency
+        0x80,       // Set Display Clock Divide Ratio and Oscillator Frequency
+        0xA8,       // Set Multiplex Ratio
+        0x3F,       // 64 COM lines
+        0xD3,       // Set display offset
+        0x00,       // 0 offset
+        0x40,       // Set start line = 0
+        0x8D,       // Charge pump
+        0x14,       // Enable charge pump
+        0x20,       // Memory addressing mode
+        0x00,       // Horizontal addressing mode
+        0xA1,       // Segment remap (column address 127 -> SEG0)
+        0xC8,       // COM scan direction (remapped mode)
+        0xDA,       // COM pins hardware config
+        0x12,       // Alternative config, disable left/right remap
+        0x81,       // Contrast control
+        0x80,       // Contrast = 128
+        0xD9,       // Pre-charge period
+        0xF1,       // Phase 1 = 15 DCLK, Phase 2 = 1 DCLK
+        0xDB,       // VCOMH Deselect level
+        0x20,       // ~0.77 x Vcc
+        0xA4,       // Display RAM content
+        0xA6,       // Normal display, 1 = ON, 0 = OFF
+        0x2E,       // Deactivate scroll
+    };
+    int ret;
+
     msleep(100);
-    ssd1306_write(module, true, 0xAE); // Entire Display OFF
-    ssd1306_write(module, true, 0xD5); // Set Display Clock Divide Ratio and Oscillator Frequency
-    ssd1306_write(module, true, 0x80); // Set Display Clock Divide Ratio and Oscillator Frequency
-    ssd1306_write(module, true, 0xA8); // Set Multiplex Ratio
-    ssd1306_write(module, true, 0x3F); // 64 COM lines
-    ssd1306_write(module, true, 0xD3); // Set display offset
-    ssd1306_write(module, true, 0x00); // 0 offset
-    ssd1306_write(module, true, 0x40); // Set start line = 0
-    ssd1306_write(module, true, 0x8D); // Charge pump
-    ssd1306_write(module, true, 0x14); // Enable charge pump
-    ssd1306_write(module, true, 0x20); // Memory addressing mode
-    ssd1306_write(module, true, 0x00); // Horizontal addressing mode
-    ssd1306_write(module, true, 0xA1); // Segment remap (column address 127 -> SEG0)
-    ssd1306_write(module, true, 0xC8); // COM scan direction (remapped mode)
-    ssd1306_write(module, true, 0xDA); // COM pins hardware config
-    ssd1306_write(module, true, 0x12); // Alternative config, disable left/right remap
-    ssd1306_write(module, true, 0x81); // Contrast control
-    ssd1306_write(module, true, 0x80); // Contrast = 128
-    ssd1306_write(module, true, 0xD9); // Pre-charge period
-    ssd1306_write(module, true, 0xF1); // Phase 1 = 15 DCLK, Phase 2 = 1 DCLK
-    ssd1306_write(module, true, 0xDB); // VCOMH Deselect level
-    ssd1306_write(module, true, 0x20); // ~0.77 x Vcc
-    ssd1306_write(module, true, 0xA4); // Display RAM content
-    ssd1306_write(module, true, 0xA6); // Normal display, 1 = ON, 0 = OFF
-    ssd1306_write(module, true, 0x2E); // Deactivate scroll
-    ssd1306_write(module, true, 0xAF); // Display ON in normal mode
+    // Cả chuỗi lệnh khởi tạo được gửi trong một transaction
+    ret = ssd1306_write_bulk(module, true, init_cmds, sizeof(init_cmds));
+    if (ret < 0)
+        return ret;
 
-    ssd1306_clear(module);
+    /*
+     * GDDRAM chưa biết nội dung sau khi bật nguồn: vẽ frame đầu tiên (trống
+     * hoặc splash) rồi gửi một lần cả frame, bật màn hình sau cùng để không
+     * thấy rác.
+     */
+    module->full_redraw = true;
+    if (splash)
+        ssd1306_print_string(module, "Hello World\n");
+    else
+        ssd1306_clear(module);
 
-    return 0;
+    ret = ssd1306_flush(module);
+    if (ret < 0)
+        return ret;
+
+    return ssd1306_write(module, true, 0xAF); // Display ON in normal mode
 }
 
 static int ssd1306_probe_new(struct i2c_client *client)
 {
     ssd1306_i2c_module_t *module;
+    int ret;
 
     pr_info("[%s - %d]\n", __func__, __LINE__);
 
-    module = kmalloc(sizeof(*module), GFP_KERNEL);
+    module = kzalloc(sizeof(*module), GFP_KERNEL);
     if(!module) {
-        pr_err("[%s - %d] kmalloc failed\n", __func__, __LINE__);
-        return -1;
+        pr_err("[%s - %d] kzalloc failed\n", __func__, __LINE__);
+        return -ENOMEM;
     }
 
     module->client = client;
+    module->info = NULL;
+    mutex_init(&module->lock);
+    mutex_init(&module->flush_lock);
+    INIT_DELAYED_WORK(&module->flush_work, ssd1306_flush_work);
+    init_waitqueue_head(&module->flush_wq);
+    module->frame_seq = 0;
+    module->flushed_seq = 0;
+    module->flush_err = 0;
+    module->dying = false;
+    kref_init(&module->ref);
+    module->max_fps = READ_ONCE(max_fps);
+    module->next_flush = jiffies;
+    module->fps_t0 = ktime_get_ns();
     module->current_line = 0;
     module->cursor_pos = 0;
     module->font_size = SSD1306_DEF_FONT_SIZE;
     i2c_set_clientdata(client, module);
 
-    ssd1306_display_init(module);
-    ssd1306_set_cursor(module, 0, 0);
-    ssd1306_print_string(module, "Hello World\n");
+    ret = ssd1306_display_init(module);
+    if (ret < 0) {
+        kfree(module);
+        pr_err("[%s - %d] display init failed %d\n", __func__, __LINE__, ret);
+        return ret;
+    }
 
-    if(ssd1306_create_device_file(module) != 0) {
+    ret = ssd1306_create_device_file(module);
+    if(ret != 0) {
         kfree(module);
         pr_err("[%s - %d] created device file failed\n", __func__, __LINE__);
-        return -1;
+        return ret;
     }
-    module_ssd1306 = module;
+
+    // Text device vẫn dùng được nếu không tạo được framebuffer
+    if (fbdev && ssd1306_fb_init(module))
+        pr_warn("[%s - %d] framebuffer not available\n", __func__, __LINE__);
     pr_info("[%s - %d]\n", __func__, __LINE__);
 
     return 0;
@@ -426,17 +1157,33 @@ static void ssd1306_i2c_remove(struct i2c_client *client)
 {
     ssd1306_i2c_module_t*module = i2c_get_clientdata(client);
 
-    ssd1306_clear(module);
+    // Gỡ fbdev và device file trước, không còn ai mở mới được
+    ssd1306_fb_exit(module);
+    ssd1306_destroy_device_file(module);
+
+    // File đang mở vẫn vẽ được vào frame nhưng không xếp flush_work nữa
+    mutex_lock(&module->lock);
+    module->dying = true;
+    mutex_unlock(&module->lock);
+    cancel_delayed_work_sync(&module->flush_work);
+    wake_up_all(&module->flush_wq);
+
+    mutex_lock(&module->lock);
     ssd1306_print_string(module, "END!!!");
+    mutex_unlock(&module->lock);
+    ssd1306_flush(module);
     msleep(1000);
+    mutex_lock(&module->lock);
     ssd1306_clear(module);
+    mutex_unlock(&module->lock);
+    ssd1306_flush(module);
+
+    mutex_lock(&module->flush_lock);
     ssd1306_write(module, true, 0xAE); // Entire Display OFF
+    mutex_unlock(&module->flush_lock);
 
-    cdev_del(&module->cdev);
-    device_destroy(module->class, module->dev_num);
-    class_destroy(module->class);
-    unregister_chrdev_region(module->dev_num, 1);
-    kfree(module);
+    // Module còn sống đến khi file cuối cùng được đóng
+    kref_put(&module->ref, ssd1306_module_free);
     pr_info("[%s - %d] End!!!\n", __func__, __LINE__);
 }
 
@@ -460,10 +1207,51 @@ static struct i2c_driver ssd1306_i2c_driver = {
     .driver = {
         .name = "ssd1306",
         // .of_match_table = ssd1306_of_match_id,
-        .owner = THIS_MODULE
+        .owner = THIS_MODULE,
+        // msleep() và truyền I2C lúc init không làm chậm boot
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
     }
 };
-module_i2c_driver(ssd1306_i2c_driver);
+
+static int __init ssd1306_init(void)
+{
+    int ret;
+
+    ret = alloc_chrdev_region(&ssd1306_devt, 0, SSD1306_MAX_DEVICES, "ssd1306_devnum");
+    if (ret < 0) {
+        pr_err("[%s - %d] cannot register major number\n", __func__, __LINE__);
+        return ret;
+    }
+
+    ssd1306_class = class_create("ssd1306_class");
+    if (IS_ERR(ssd1306_class)) {
+        pr_err("[%s - %d] cannot register class device\n", __func__, __LINE__);
+        ret = PTR_ERR(ssd1306_class);
+        goto create_class_failed;
+    }
+
+    ret = i2c_add_driver(&ssd1306_i2c_driver);
+    if (ret)
+        goto add_driver_failed;
+
+    return 0;
+
+add_driver_failed:
+    class_destroy(ssd1306_class);
+create_class_failed:
+    unregister_chrdev_region(ssd1306_devt, SSD1306_MAX_DEVICES);
+    return ret;
+}
+
+static void __exit ssd1306_exit(void)
+{
+    i2c_del_driver(&ssd1306_i2c_driver);
+    class_destroy(ssd1306_class);
+    unregister_chrdev_region(ssd1306_devt, SSD1306_MAX_DEVICES);
+}
+
+module_init(ssd1306_init);
+module_exit(ssd1306_exit);
 
 MODULE_AUTHOR("dungla anhdungxd21@mail.com");
 MODULE_LICENSE("GPL");
\ No newline at end of file
@@ -0,0 +1,116 @@
+/*
+ * Row-major 1bpp image -> SSD1306 page layout, shared by the driver and the
+ * user space benchmark in bench/.
+ *
+ * Image: 8 pixels per byte, leftmost pixel in the MSB, lines packed with no
+ * padding. 0 and 180 degrees take a 128x64 image (16 bytes per line), 90 and
+ * 270 a 64x128 one (8 bytes per line) that is turned clockwise onto the
+ * panel. Both are SSD1306_IMG_BYTES long.
+ *
+ * Pages: byte [page][x] holds pixels (x, page * 8 .. page * 8 + 7), the top
+ * one in bit 0.
+ *
+ * Work is done on 8x8 pixel blocks held in one 64-bit word, byte i = line i
+ * of the block. 0 and 180 degrees need a real bit matrix transpose (3 masked
+ * swap steps), 90 and 270 degrees are already column-major in the source and
+ * only need bytes reordered or bit-reversed.
+ */
+#ifndef _SSD1306_BITMAP_H
+#define _SSD1306_BITMAP_H
+
+#include <linux/types.h>
+
+#define SSD1306_IMG_W           128
+#define SSD1306_IMG_H           64
+#define SSD1306_IMG_PAGES       (SSD1306_IMG_H / 8)
+#define SSD1306_IMG_BYTES       (SSD1306_IMG_W * SSD1306_IMG_H / 8)
+
+/* Bit j of byte i moves to bit i of byte j */
+static inline __u64 ssd1306_transpose8(__u64 x)
+{
+    __u64 t;
+
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+
+    return x;
+}
+
+/* Reverse the bit order inside every byte */
+static inline __u64 ssd1306_bitrev8x8(__u64 x)
+{
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+
+    return x;
+}
+
+/* 8 lines of one byte each, stride bytes apart; step -1 loads them bottom up */
+static inline __u64 ssd1306_load8(const __u8 *p, int stride)
+{
+    __u64 x = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        x |= (__u64)p[i * stride] << (i * 8);
+
+    return x;
+}
+
+/* Returns -1 (nothing written) for a rotation other than 0/90/180/270 */
+static inline int ssd1306_img_to_pages(__u8 pages[SSD1306_IMG_PAGES][SSD1306_IMG_W],
+                                       const __u8 *img, unsigned int rotate)
+{
+    const int line0 = SSD1306_IMG_W / 8;        /* Bytes per line at 0/180 */
+    const int line90 = SSD1306_IMG_H / 8;       /* Bytes per line at 90/270 */
+    int page, xb, c;
+    __u64 x;
+
+    if (rotate != 0 && rotate != 90 && rotate != 180 && rotate != 270)
+        return -1;
+
+    for (page = 0; page < SSD1306_IMG_PAGES; page++) {
+        for (xb = 0; xb < SSD1306_IMG_W / 8; xb++) {
+            __u8 *out = &pages[page][xb * 8];
+
+            switch (rotate) {
+            case 0:
+                /* Column c is bit 7 - c of every line */
+                x = ssd1306_transpose8(ssd1306_load8(&img[page * 8 * line0 + xb], line0));
+                for (c = 0; c < 8; c++)
+                    out[c] = x >> ((7 - c) * 8);
+                break;
+            case 180:
+                /* Same block mirrored: last line first, column c is bit c */
+                x = ssd1306_load8(&img[(SSD1306_IMG_H - 1 - page * 8) * line0 +
+                                       line0 - 1 - xb], -line0);
+                x = ssd1306_transpose8(x);
+                for (c = 0; c < 8; c++)
+                    out[c] = x >> (c * 8);
+                break;
+            case 90:
+                /* Panel column c is source line 7 - c of the block, top pixel in the MSB */
+                x = ssd1306_load8(&img[(SSD1306_IMG_W - 8 - xb * 8) * line90 + page], line90);
+                x = ssd1306_bitrev8x8(x);
+                for (c = 0; c < 8; c++)
+                    out[c] = x >> ((7 - c) * 8);
+                break;
+            case 270:
+                /* Panel column c is source line c, top pixel already in the LSB */
+                x = ssd1306_load8(&img[xb * 8 * line90 + line90 - 1 - page], line90);
+                for (c = 0; c < 8; c++)
+                    out[c] = x >> (c * 8);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+#endif /* _SSD1306_BITMAP_H */
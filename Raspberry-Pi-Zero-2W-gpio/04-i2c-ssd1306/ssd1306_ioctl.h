@@ -0,0 +1,33 @@
+/*
+ * ioctl interface of /dev/ssd1306, shared between the driver (ssd1306-i2c.c)
+ * and user space programs.
+ */
+#ifndef _SSD1306_IOCTL_H
+#define _SSD1306_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define SSD1306_IOC_MAGIC       'S'
+
+/*
+ * write() only updates the frame in memory and returns, the panel is updated
+ * in the background. Wait until everything written before this call is on
+ * the panel, fsync() does the same.
+ */
+#define SSD1306_IOC_WAIT_FLUSH  _IO(SSD1306_IOC_MAGIC, 1)
+
+/*
+ * Replace the screen with a 1bpp image, SSD1306_IMG_BYTES (1024) bytes,
+ * leftmost pixel in the MSB. rotate is 0, 90, 180 or 270 (clockwise): 0 and
+ * 180 take a 128x64 image, 90 and 270 a 64x128 one. See ssd1306_bitmap.h.
+ */
+struct ssd1306_image {
+    __u64 data;                 /* User pointer */
+    __u32 rotate;
+    __u32 reserved;             /* Must be 0 */
+};
+
+#define SSD1306_IOC_DRAW_IMAGE  _IOW(SSD1306_IOC_MAGIC, 2, struct ssd1306_image)
+
+#endif /* _SSD1306_IOCTL_H */
@@ -10,6 +10,8 @@
 #include <linux/cdev.h>
 #include <linux/of_gpio.h>
 #include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 
 /* Device naming */
 #define DEVNUM_NAME         "nokia5110_devnum"
@@ -28,6 +30,11 @@
 #define NOKIA5110_HEIGHT    48
 #define NOKIA5110_NUM_BANK  6
 
+/* Longest command group sent in one transfer (the init sequence) */
+#define NOKIA5110_MAX_CMDS  8
+/* SPI clock of every transfer */
+#define NOKIA5110_SPI_HZ    4000000
+
 /* LCD modes */
 #define NOKIA5110_MODE_CMD  0
 #define NOKIA5110_MODE_DATA 1
@@ -44,6 +51,10 @@
 #define LCD_CMD_SET_X       0x80    /* Set X coordinate (OR with position) */
 #define LCD_CMD_SET_Y       0x40    /* Set Y coordinate (OR with position) */
 
+static unsigned int max_fps;
+module_param(max_fps, uint, 0644);
+MODULE_PARM_DESC(max_fps, "Default frame rate limit, 0 = flush as fast as the bus allows");
+
 /* Union for LCD commands with parameters */
 typedef union {
     struct {
@@ -68,6 +79,34 @@ typedef struct {
     /* Current position */
     uint8_t x_pos;
     uint8_t y_pos;
+
+    /* Protects frame, frame_seq, dying and the text position */
+    struct mutex lock;
+    /* Serializes flushes: snap, cmd_buf and the SPI stream */
+    struct mutex flush_lock;
+    /* Text is drawn here, the flush work sends the whole frame to the LCD */
+    uint8_t frame[NOKIA5110_NUM_BANK][NOKIA5110_WIDTH];
+    struct delayed_work flush_work;
+    u64 frame_seq;              /* Bumped on every frame update */
+    u64 flushed_seq;            /* frame_seq of the last frame on the LCD */
+    bool dying;                 /* Set by remove, updates no longer schedule a flush */
+
+    /* Pacing: no flush starts before next_flush (jiffies), 0 fps = no limit */
+    unsigned int max_fps;
+    unsigned long next_flush;
+    /* Statistics, written by the flush */
+    u64 dropped;                /* Updates replaced before reaching the LCD */
+    u64 fps_t0;                 /* Start of the current 1 s window (ns) */
+    unsigned int fps_frames;
+    unsigned int fps_x10;       /* Rate of the last full window, in 0.1 fps */
+
+    /*
+     * SPI tx buffers, each on its own cache lines so they can be DMA mapped.
+     * Only touched with flush_lock held.
+     */
+    uint8_t cmd_buf[NOKIA5110_MAX_CMDS] ____cacheline_aligned;
+    /* Copy of frame taken by the flush, writers do not wait for SPI */
+    uint8_t snap[NOKIA5110_NUM_BANK][NOKIA5110_WIDTH] ____cacheline_aligned;
 } nokia5110_t;
 
 /* Global variables */
@@ -76,11 +115,14 @@ static nokia5110_t *module_nokia5110 = NULL;
 /* Function prototypes */
 static void nokia5110_init(void);
 static void nokia5110_clear_screen(void);
-static int nokia5110_send_byte(bool is_data, unsigned char data);
+static int nokia5110_send_bulk(bool is_data, const uint8_t *buf, size_t len);
+static int nokia5110_send_cmds(const uint8_t *cmds, size_t len);
 static void nokia5110_print_char(char c);
 static void nokia5110_print_string(const char* str);
 static void nokia5110_set_position(uint8_t x, uint8_t y);
 static void nokia5110_cleanup(void);
+static int nokia5110_flush(void);
+static void nokia5110_frame_updated(void);
 
 /* File operations */
 static int nokia5110_open(struct inode *inodep, struct file *filep);
@@ -196,32 +238,78 @@ static struct file_operations fops = {
     .read = nokia5110_read
 };
 
+/**
+ * @brief Move the text position in the frame, the LCD address is set by the flush
+ */
 static void nokia5110_set_position(uint8_t x, uint8_t y)
 {
-    int ret;
-
     /* Validate coordinates */
     if (x >= NOKIA5110_WIDTH || y >= NOKIA5110_NUM_BANK) {
         return;
     }
 
-    /* Send commands to set position */
-    ret = nokia5110_send_byte(NOKIA5110_MODE_CMD, LCD_CMD_SET_X | x);
-    if (ret < 0) {
-        pr_err("[%s - %d] Failed to set X position", __func__, __LINE__);
-        return;
-    }
-
-    ret = nokia5110_send_byte(NOKIA5110_MODE_CMD, LCD_CMD_SET_Y | y);
-    if (ret < 0) {
-        pr_err("[%s - %d] Failed to set Y position", __func__, __LINE__);
-        return;
-    }
-
     module_nokia5110->x_pos = x;
     module_nokia5110->y_pos = y;
 }
 
+/*
+ * /sys/class/nokia5110_class/nokia5110/:
+ *   max_fps         frame rate limit, 0 = none
+ *   fps             achieved rate over the last second, 0 when idle
+ *   dropped_frames  updates replaced by a newer one before being flushed
+ */
+static ssize_t max_fps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    nokia5110_t *module = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(module->max_fps));
+}
+
+static ssize_t max_fps_store(struct device *dev, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    nokia5110_t *module = dev_get_drvdata(dev);
+    unsigned int fps;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &fps);
+    if (ret)
+        return ret;
+
+    WRITE_ONCE(module->max_fps, fps);
+    return count;
+}
+static DEVICE_ATTR_RW(max_fps);
+
+static ssize_t fps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    nokia5110_t *module = dev_get_drvdata(dev);
+    unsigned int fps = READ_ONCE(module->fps_x10);
+
+    /* No frame for 2 seconds: the LCD is idle */
+    if (ktime_get_ns() - READ_ONCE(module->fps_t0) > 2 * NSEC_PER_SEC)
+        fps = 0;
+
+    return sysfs_emit(buf, "%u.%u\n", fps / 10, fps % 10);
+}
+static DEVICE_ATTR_RO(fps);
+
+static ssize_t dropped_frames_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    nokia5110_t *module = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%llu\n", READ_ONCE(module->dropped));
+}
+static DEVICE_ATTR_RO(dropped_frames);
+
+static struct attribute *nokia5110_attrs[] = {
+    &dev_attr_max_fps.attr,
+    &dev_attr_fps.attr,
+    &dev_attr_dropped_frames.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(nokia5110);
+
 static int nokia5110_creat_device_file(nokia5110_t * module)
 {
     int ret;
@@ -245,8 +333,9 @@ static int nokia5110_creat_device_file(nokia5110_t * module)
         goto create_class_failed;
     }
 
-    /* Create device file */
-    module->device = device_create(module->class, NULL, module->dev_num, NULL, CDEV_NAME_DEVICE);
+    /* Create device file, with the frame rate attributes */
+    module->device = device_create_with_groups(module->class, NULL, module->dev_num, module,
+                                               nokia5110_groups, CDEV_NAME_DEVICE);
     if(IS_ERR(module->device)) {
         ret = PTR_ERR(module->device);
         pr_err("[%s - %d] Cannot create device file: %d\n", __func__, __LINE__, ret);
@@ -280,82 +369,88 @@ alloc_dev_failed:
 }
 
 /**
- * @param is_data True for data, false for command
- * @param data Byte to send
+ * @brief Send a run of commands or data with DC set once
+ *
+ * The whole run goes in one spi_message, split only if the controller limits
+ * the transfer size. buf must be DMA-safe (cmd_buf/snap, not the stack).
+ *
+ * @param is_data True for data, false for commands
+ * @param buf Bytes to send
+ * @param len Number of bytes
  * @return 0 on success, error code on failure
  */
-static int nokia5110_send_byte(bool is_data, unsigned char data)
+static int nokia5110_send_bulk(bool is_data, const uint8_t *buf, size_t len)
 {
-    int ret;
+    struct spi_device *spi = module_nokia5110->spi_dev;
+    size_t max = spi_max_transfer_size(spi);
     struct spi_transfer t;
     struct spi_message m;
+    int ret;
 
     /* set DC pin according to data/command mode */
     gpio_set_value(module_nokia5110->dc_pin, is_data ? HIGH : LOW);
 
-    /* Initialize SPI message */
-    memset(&t, 0, sizeof(t));
-    spi_message_init(&m);
+    while (len) {
+        /* Initialize SPI message */
+        memset(&t, 0, sizeof(t));
+        spi_message_init(&m);
 
-    /* Set up transfer */
-    t.tx_buf = &data;
-    t.len = 1;
-    t.speed_hz = 4000000; /* 4MHz */
-    spi_message_add_tail(&t, &m);
+        /* Set up transfer */
+        t.tx_buf = buf;
+        t.len = min(len, max);
+        t.speed_hz = NOKIA5110_SPI_HZ;
+        spi_message_add_tail(&t, &m);
 
-    /* Perform transfer */
-    ret = spi_sync(module_nokia5110->spi_dev, &m);
-    if (ret < 0) {
-        pr_err("[%s - %d] SPI transfer failed: %d\n", __func__, __LINE__, ret);
+        /* Perform transfer */
+        ret = spi_sync(spi, &m);
+        if (ret < 0) {
+            pr_err("[%s - %d] SPI transfer failed: %d\n", __func__, __LINE__, ret);
+            return ret;
+        }
+
+        buf += t.len;
+        len -= t.len;
     }
 
-    /* Add small delay for stability */
-    udelay(1);
+    return 0;
+}
 
-    return ret;
+/**
+ * @brief Send a group of commands in one transfer, through the DMA-safe cmd_buf
+ */
+static int nokia5110_send_cmds(const uint8_t *cmds, size_t len)
+{
+    if (WARN_ON(len > sizeof(module_nokia5110->cmd_buf)))
+        return -EINVAL;
+
+    memcpy(module_nokia5110->cmd_buf, cmds, len);
+    return nokia5110_send_bulk(NOKIA5110_MODE_CMD, module_nokia5110->cmd_buf, len);
 }
 
+/**
+ * @brief Blank the frame and move the text position home, the LCD follows on the next flush
+ */
 static void nokia5110_clear_screen(void)
 {
-    int index = 0;
-    int ret;
+    memset(module_nokia5110->frame, 0, sizeof(module_nokia5110->frame));
 
     /* Set cursor to home position */
     nokia5110_set_position(0, 0);
-
-    /* Fill screen with zeros */
-    for(index = 0; index < NOKIA5110_WIDTH * NOKIA5110_HEIGHT / 8; index ++) {
-        ret = nokia5110_send_byte(NOKIA5110_MODE_DATA, 0x00);
-        if(ret < 0) {
-            pr_err("[%s - %d] Failed to clear screen\n", __func__, __LINE__);
-            return;
-        }
-    }
 }
 
 static void nokia5110_print_char(char c)
 {
+    uint8_t *col = &module_nokia5110->frame[module_nokia5110->y_pos][module_nokia5110->x_pos];
     int i = 0;
-    int ret;
 
-    /* Send empty column before character */
-    ret = nokia5110_send_byte(NOKIA5110_MODE_DATA, 0x00);
-    if (ret < 0) {
-        return;
-    }
-    
-    /* Send charactor data (5 column) */
-    for(i = 0; i < 5; i++) {
-        ret = nokia5110_send_byte(NOKIA5110_MODE_DATA, ASCII[c - 0x20][i]);
-        if (ret < 0) {
-            return;
-        }
-    }
+    /* Characters missing from the font are drawn as spaces */
+    if (c < 0x20 || c >= 0x20 + ARRAY_SIZE(ASCII))
+        c = ' ';
 
-    /* Send empty column after character */
-    ret = nokia5110_send_byte(NOKIA5110_MODE_DATA, 0x00);
-    if (ret < 0) {
-        return;
+    /* Empty column before character, then charactor data (5 column) */
+    *col++ = 0x00;
+    for(i = 0; i < 5; i++) {
+        *col++ = ASCII[c - 0x20][i];
     }
 
     /* Update position */
@@ -394,6 +489,16 @@ static void nokia5110_print_string(const char* data)
 
 static void nokia5110_init(void)
 {
+    static const uint8_t init_cmds[] = {
+        LCD_CMD_EXTENDED,   /* LCD extended Commands */
+        LCD_CMD_CONTRAST,   /* Set LCD Contrast */
+        LCD_CMD_TEMP_COEF,  /* Set Temp coefficient */
+        LCD_CMD_BIAS,       /* LCD Bias mod 1:48 */
+        LCD_CMD_BASIC,      /* LCD Basic Commands */
+        LCD_CMD_NORMAL,     /* LCD in normal mode */
+        /* Additional intitialization commands for better display quality */
+        LCD_CMD_DISPLAY_ON,
+    };
     int ret;
 
     pr_info("[%s - %d] Nokia5110 display intialization\n", __func__, __LINE__);
@@ -422,23 +527,111 @@ static void nokia5110_init(void)
     gpio_set_value(module_nokia5110->rst_pin, HIGH);
     mdelay(10);    /* Allow LCD to stabilize */
 
-    /* Initialize LCD with improved sequence sequence */
-    nokia5110_send_byte(NOKIA5110_MODE_CMD, LCD_CMD_EXTENDED);  /* LCD extended Commands */
-    nokia5110_send_byte(NOKIA5110_MODE_CMD, LCD_CMD_CONTRAST);  /* Set LCD Contrast */
-    nokia5110_send_byte(NOKIA5110_MODE_CMD, LCD_CMD_TEMP_COEF); /* Set Temp coefficient */
-    nokia5110_send_byte(NOKIA5110_MODE_CMD, LCD_CMD_BIAS);      /* LCD Bias mod 1:48 */
-    nokia5110_send_byte(NOKIA5110_MODE_CMD, LCD_CMD_BASIC);     /* LCD Basic Commands */
-    nokia5110_send_byte(NOKIA5110_MODE_CMD, LCD_CMD_NORMAL);    /* LCD in normal mode */
-
-    /* Additional intitialization commands for better display quality */
-    nokia5110_send_byte(NOKIA5110_MODE_CMD, LCD_CMD_DISPLAY_ON);
+    /* Initialize LCD with improved sequence sequence, all in one transfer */
+    mutex_lock(&module_nokia5110->flush_lock);
+    ret = nokia5110_send_cmds(init_cmds, sizeof(init_cmds));
+    mutex_unlock(&module_nokia5110->flush_lock);
+    if (ret < 0) {
+        pr_err("[%s - %d] Failed to send init sequence\n", __func__, __LINE__);
+    }
 
     /* Clear screen and set cursor position */
     nokia5110_clear_screen();
+}
+
+/*
+ * Called by the flush, seq is the frame it is about to send. Frames between
+ * the last one shown and seq were replaced before they reached the LCD. Also
+ * arms the pacing deadline for the next flush.
+ */
+static void nokia5110_account_frame(u64 seq)
+{
+    nokia5110_t *module = module_nokia5110;
+    unsigned int fps = READ_ONCE(module->max_fps);
+    u64 now = ktime_get_ns();
+
+    WRITE_ONCE(module->next_flush, jiffies + (fps ? DIV_ROUND_UP(HZ, fps) : 0));
+
+    if (seq <= module->flushed_seq)
+        return;
+
+    WRITE_ONCE(module->dropped, module->dropped + seq - module->flushed_seq - 1);
+    module->fps_frames++;
+    if (now - module->fps_t0 >= NSEC_PER_SEC) {
+        WRITE_ONCE(module->fps_x10, div64_u64((u64)module->fps_frames * 10 * NSEC_PER_SEC,
+                                              now - module->fps_t0));
+        WRITE_ONCE(module->fps_t0, now);
+        module->fps_frames = 0;
+    }
+}
+
+/**
+ * @brief Send the newest frame to the LCD, from address (0, 0) to the end
+ *
+ * Runs from flush_work and directly in probe/remove, flush_lock keeps them
+ * apart. flushed_seq only moves once the frame is on the LCD.
+ */
+static int nokia5110_flush(void)
+{
+    static const uint8_t home_cmds[] = { LCD_CMD_SET_X | 0, LCD_CMD_SET_Y | 0 };
+    nokia5110_t *module = module_nokia5110;
+    u64 seq;
+    int ret;
+
+    mutex_lock(&module->flush_lock);
+
+    mutex_lock(&module->lock);
+    memcpy(module->snap, module->frame, sizeof(module->frame));
+    seq = module->frame_seq;
+    mutex_unlock(&module->lock);
+
+    /*
+     * One command transfer to go home, then the 504 bytes in one data
+     * transfer: horizontal addressing wraps from bank to bank by itself.
+     */
+    ret = nokia5110_send_cmds(home_cmds, sizeof(home_cmds));
+    if (ret < 0) {
+        pr_err("[%s - %d] Failed to set position: %d\n", __func__, __LINE__, ret);
+        goto out;
+    }
+
+    ret = nokia5110_send_bulk(NOKIA5110_MODE_DATA, &module->snap[0][0], sizeof(module->snap));
+    if (ret < 0) {
+        pr_err("[%s - %d] Failed to send frame: %d\n", __func__, __LINE__, ret);
+        goto out;
+    }
+
+    nokia5110_account_frame(seq);
+    module->flushed_seq = seq;
+    ret = 0;
+
+out:
+    mutex_unlock(&module->flush_lock);
+    return ret;
+}
+
+/*
+ * Writes that arrive while a flush is pending or running only re-queue the
+ * work: they are coalesced into one flush of the newest frame, which waits
+ * for the pacing deadline when max_fps is set. Under overload the LCD shows
+ * the latest frame at that rate and the frames in between are dropped.
+ */
+static void nokia5110_flush_work(struct work_struct *work)
+{
+    nokia5110_flush();
+}
+
+/* Called with module->lock held after drawing into frame */
+static void nokia5110_frame_updated(void)
+{
+    nokia5110_t *module = module_nokia5110;
+    unsigned long next = READ_ONCE(module->next_flush);
 
-    /* Initialize position variable */
-    module_nokia5110->x_pos = 0;
-    module_nokia5110->y_pos = 0;
+    module->frame_seq++;
+    if (module->dying)
+        return;
+    schedule_delayed_work(&module->flush_work,
+                          time_after(next, jiffies) ? next - jiffies : 0);
 }
 
 /**
@@ -448,9 +641,19 @@ static void nokia5110_cleanup(void)
 {
     pr_info("[%s - %d] Cleaning up Nokia5110 resources\n", __func__, __LINE__);
 
-    /* Clear screen before shutdown */
+    /* Clear screen before shutdown, pending updates are dropped */
     if (module_nokia5110 && module_nokia5110->spi_dev) {
+        mutex_lock(&module_nokia5110->lock);
+        module_nokia5110->dying = true;
+        mutex_unlock(&module_nokia5110->lock);
+
+        /* Nothing can requeue the work now */
+        cancel_delayed_work_sync(&module_nokia5110->flush_work);
+
+        mutex_lock(&module_nokia5110->lock);
         nokia5110_clear_screen();
+        mutex_unlock(&module_nokia5110->lock);
+        nokia5110_flush();
     }
 
     /* Free GPIO pins */
@@ -500,27 +703,33 @@ static ssize_t nokia5110_write(struct file *filep, const char __user *buf, size_
 
     pr_info("[%s - %d] Writing to device\n", __func__, __LINE__);
 
-    /* Clear message buffer */
-    memset(message, 0x0, sizeof(message));
-
     /* Check for buffer overflow */
     if (len > sizeof(message) - 1) {
         pr_info("[%s - %d] Input data too large, truncating to %zu bytes\n", __func__, __LINE__, sizeof(message) -1);
         len = sizeof(message) - 1;
     }
 
+    mutex_lock(&module_nokia5110->lock);
+
+    /* Clear message buffer */
+    memset(message, 0x0, sizeof(message));
+
     /* Copy data from user space */
     ret = copy_from_user(message, buf, len);
     if (ret) {
+        mutex_unlock(&module_nokia5110->lock);
         pr_err("[%s - %d] Wcopy_from_user failed: %d bytes not copied\n", __func__, __LINE__, ret);
         return -EFAULT;
     }
 
     pr_info("[%s - %d] Data from user: %s\n", __func__, __LINE__, message);
 
-    /* Clear screen and print message */
+    /* Clear screen and print message, the flush work sends it to the LCD */
     nokia5110_clear_screen();
     nokia5110_print_string(message);
+    nokia5110_frame_updated();
+
+    mutex_unlock(&module_nokia5110->lock);
 
     return len;
 }
@@ -599,12 +808,19 @@ static int nokia5110_spi_probe(struct spi_device* spi)
         goto err_free_module;
     }
 
-    /* Create device file */
-    ret = nokia5110_creat_device_file(module);
-    if(ret != 0) {
-        pr_err("[%s - %d] Failed to create device file: %d\n", __func__, __LINE__, ret);
-        goto err_free_module;
-    }
+    /* Frame and flush work must be ready before the device file appears */
+    mutex_init(&module->lock);
+    mutex_init(&module->flush_lock);
+    INIT_DELAYED_WORK(&module->flush_work, nokia5110_flush_work);
+    module->frame_seq = 0;
+    module->flushed_seq = 0;
+    module->dying = false;
+    module->max_fps = READ_ONCE(max_fps);
+    module->next_flush = jiffies;
+    module->dropped = 0;
+    module->fps_t0 = ktime_get_ns();
+    module->fps_frames = 0;
+    module->fps_x10 = 0;
 
     /* Store SPI device in module structure */
     module->spi_dev = spi;
@@ -613,9 +829,22 @@ static int nokia5110_spi_probe(struct spi_device* spi)
     /* Initialize LCD */
     nokia5110_init();
 
-    /* Display welcome message */
+    /* Display welcome message, no writer can race with us yet */
     nokia5110_clear_screen();
     nokia5110_print_string("Hello World\n");
+    ret = nokia5110_flush();
+    if (ret < 0) {
+        pr_err("[%s - %d] Failed to show welcome message: %d\n", __func__, __LINE__, ret);
+    }
+
+    /* Create device file last, writes can start as soon as it exists */
+    ret = nokia5110_creat_device_file(module);
+    if(ret != 0) {
+        pr_err("[%s - %d] Failed to create device file: %d\n", __func__, __LINE__, ret);
+        nokia5110_cleanup();
+        module_nokia5110 = NULL;
+        goto err_free_module;
+    }
 
     pr_info("[%s - %d] Nokia5110 device create successfully\n", __func__, __LINE__);
 
@@ -635,12 +864,12 @@ static void nokia5110_spi_remove(struct spi_device* spi)
 
     pr_info("[%s - %d] Removing Nokia5110 SPI device\n", __func__, __LINE__);
 
+    /* Clean up device file first, no new writer can come in */
+    nokia5110_destroy_device_file(module);
+
     /* Clean up LCD resources*/
     nokia5110_cleanup();
 
-    /* Clean up device file*/
-    nokia5110_destroy_device_file(module);
-
     /* Free module memory*/
     kfree(module);
     module_nokia5110 = NULL;